@@ -17,9 +17,17 @@ struct ADSR {
 	float release_coef, release_base;
 	float sustain_level;
 
+	// as given to set_attack() etc., to recompute from on a rate change
+	float attack_time = -1.0f, attack_slope;
+	float decay_time = -1.0f, decay_slope;
+	float release_time = -1.0f, release_slope;
+
 	void set_sample_rate(float value)
 	{
 		sample_rate = value;
+		if (attack_time >= 0.0f) set_attack(attack_time, attack_slope);
+		if (decay_time >= 0.0f) set_decay(decay_time, decay_slope);
+		if (release_time >= 0.0f) set_release(release_time, release_slope);
 	}
 
 	void on()
@@ -34,14 +42,23 @@ struct ADSR {
 		}
 	}
 
+	bool idle()
+	{
+		return state == IDLE;
+	}
+
 	void set_attack(float value, float slope)
 	{
+		attack_time = value;
+		attack_slope = slope;
 		attack_coef = slope_coef(value * sample_rate, slope);
 		attack_base = (1.0f + slope) * (1.0f - attack_coef);
 	}
 
 	void set_decay(float value, float slope)
 	{
+		decay_time = value;
+		decay_slope = slope;
 		decay_coef = slope_coef(value * sample_rate, slope);
 		decay_base = (sustain_level - slope) * (1.0f - decay_coef);
 	}
@@ -53,6 +70,8 @@ struct ADSR {
 
 	void set_release(float value, float slope)
 	{
+		release_time = value;
+		release_slope = slope;
 		release_coef = slope_coef(value * sample_rate, slope);
 		release_base = -slope * (1.0f - release_coef);
 	}
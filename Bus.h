@@ -1,9 +1,113 @@
 #pragma once
 
 #include <string.h>
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 #include "assert.h"
 
+/*
+per-frame channel loops. the generic versions are left to the compiler; the
+float specializations do a frame in one or two SSE (or AVX) operations
+regardless of how well the caller got vectorized. block-wise work should use
+the kernels in BusBuffer.h instead.
+*/
+template <typename T, int CH>
+struct BusOps {
+	static inline void accumulate(T* dst, const T* src)
+	{
+		for (int i = 0; i < CH; i++) dst[i] += src[i];
+	}
+
+	static inline void scale(T* dst, const T* src, T scalar)
+	{
+		for (int i = 0; i < CH; i++) dst[i] = src[i] * scalar;
+	}
+
+	static inline T sum(const T* src)
+	{
+		T result = T();
+		for (int i = 0; i < CH; i++) result += src[i];
+		return result;
+	}
+};
+
+static inline __m128 _bus_load2(const float* p)
+{
+	return _mm_castpd_ps(_mm_load_sd((const double*)p));
+}
+
+static inline void _bus_store2(float* p, __m128 v)
+{
+	_mm_store_sd((double*)p, _mm_castps_pd(v));
+}
+
+template <>
+struct BusOps<float, 2> {
+	static inline void accumulate(float* dst, const float* src)
+	{
+		_bus_store2(dst, _mm_add_ps(_bus_load2(dst), _bus_load2(src)));
+	}
+
+	static inline void scale(float* dst, const float* src, float scalar)
+	{
+		_bus_store2(dst, _mm_mul_ps(_bus_load2(src), _mm_set1_ps(scalar)));
+	}
+
+	static inline float sum(const float* src)
+	{
+		return src[0] + src[1];
+	}
+};
+
+template <>
+struct BusOps<float, 4> {
+	static inline void accumulate(float* dst, const float* src)
+	{
+		_mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), _mm_loadu_ps(src)));
+	}
+
+	static inline void scale(float* dst, const float* src, float scalar)
+	{
+		_mm_storeu_ps(dst, _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(scalar)));
+	}
+
+	static inline float sum(const float* src)
+	{
+		return (src[0] + src[1]) + (src[2] + src[3]);
+	}
+};
+
+template <>
+struct BusOps<float, 8> {
+	static inline void accumulate(float* dst, const float* src)
+	{
+		#ifdef __AVX__
+		_mm256_storeu_ps(dst, _mm256_add_ps(_mm256_loadu_ps(dst), _mm256_loadu_ps(src)));
+		#else
+		BusOps<float, 4>::accumulate(dst, src);
+		BusOps<float, 4>::accumulate(dst + 4, src + 4);
+		#endif
+	}
+
+	static inline void scale(float* dst, const float* src, float scalar)
+	{
+		#ifdef __AVX__
+		_mm256_storeu_ps(dst, _mm256_mul_ps(_mm256_loadu_ps(src), _mm256_set1_ps(scalar)));
+		#else
+		BusOps<float, 4>::scale(dst, src, scalar);
+		BusOps<float, 4>::scale(dst + 4, src + 4, scalar);
+		#endif
+	}
+
+	static inline float sum(const float* src)
+	{
+		return BusOps<float, 4>::sum(src) + BusOps<float, 4>::sum(src + 4);
+	}
+};
+
 template <typename _T, int _CH>
 struct Bus {
 	typedef _T T;
@@ -21,27 +125,19 @@ struct Bus {
 
 	void accumulate(Bus<T,CH> other)
 	{
-		for (int i = 0; i < CH; i++) {
-			value[i] += other.value[i];
-		}
+		BusOps<T,CH>::accumulate(value, other.value);
 	}
 
 	Bus<T,CH> scale(T scalar)
 	{
 		Bus<T,CH> result;
-		for (int i = 0; i < CH; i ++) {
-			result.value[i] = value[i] * scalar;
-		}
+		BusOps<T,CH>::scale(result.value, value, scalar);
 		return result;
 	}
 
 	T sum()
 	{
-		T result = T();
-		for (int i = 0; i < CH; i++) {
-			result += value[i];
-		}
-		return result;
+		return BusOps<T,CH>::sum(value);
 	}
 
 	Bus<T,CH> operator*(T scalar)
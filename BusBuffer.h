@@ -0,0 +1,292 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+#include "Bus.h"
+#include "assert.h"
+
+/*
+block kernels over arrays of buses. a Bus<float,CH> array is just n*CH
+interleaved floats, so gain and mix run over it flat, 4 (SSE) or 8 (AVX)
+floats at a time, whatever the channel count; the kernels that care about
+channels (ramped mixes, panning, channel sums, planar conversion) have
+vectorized paths for the common layouts and plain loops for the rest. buses
+of other sample types always take the plain loops.
+
+BusBuffer is a 64-byte aligned block of buses with these as methods, for
+components that keep scratch blocks; the kernels themselves accept any
+pointer.
+*/
+
+template <typename BUS>
+struct BusIsFloat {
+	static constexpr bool value = std::is_same<typename BUS::T, float>::value && sizeof(BUS) == sizeof(float) * BUS::CH;
+};
+
+// flat float kernels; count is in floats
+
+static inline void busk_gain(float* dst, const float* src, float gain, int count)
+{
+	int i = 0;
+	#ifdef __AVX__
+	const __m256 g8 = _mm256_set1_ps(gain);
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), g8));
+	}
+	#endif
+	const __m128 g = _mm_set1_ps(gain);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+	}
+	for (; i < count; i++) dst[i] = src[i] * gain;
+}
+
+static inline void busk_mix(float* dst, const float* src, float gain, int count)
+{
+	int i = 0;
+	#ifdef __AVX__
+	const __m256 g8 = _mm256_set1_ps(gain);
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_mul_ps(_mm256_loadu_ps(src + i), g8);
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), x));
+	}
+	#endif
+	const __m128 g = _mm_set1_ps(gain);
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), x));
+	}
+	for (; i < count; i++) dst[i] += src[i] * gain;
+}
+
+// gain goes from gain to gain + n*dgain over the n frames
+static inline void busk_mix_ramp(float* dst, const float* src, float gain, float dgain, int ch, int n)
+{
+	int i = 0;
+	if (ch == 1 || ch == 2 || ch == 4) {
+		// 4 floats span 4/ch frames
+		const int fpv = 4 / ch;
+		float gs[4];
+		for (int k = 0; k < 4; k++) gs[k] = (float)(k / ch) * dgain;
+		__m128 g = _mm_add_ps(_mm_set1_ps(gain), _mm_loadu_ps(gs));
+		const __m128 step = _mm_set1_ps(dgain * (float)fpv);
+		for (; i + fpv <= n; i += fpv) {
+			const size_t j = (size_t)i * ch;
+			__m128 x = _mm_mul_ps(_mm_loadu_ps(src + j), g);
+			_mm_storeu_ps(dst + j, _mm_add_ps(_mm_loadu_ps(dst + j), x));
+			g = _mm_add_ps(g, step);
+		}
+		gain += dgain * (float)i;
+	}
+	for (; i < n; i++) {
+		for (int c = 0; c < ch; c++) dst[(size_t)i * ch + c] += src[(size_t)i * ch + c] * gain;
+		gain += dgain;
+	}
+}
+
+// mono to stereo, with a gain per side; also the mono-to-interleaved copy
+static inline void busk_pan(float* dst, const float* src, float gain_l, float gain_r, int n)
+{
+	int i = 0;
+	const __m128 g = _mm_setr_ps(gain_l, gain_r, gain_l, gain_r);
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(src + i);
+		_mm_storeu_ps(dst + i * 2, _mm_mul_ps(_mm_unpacklo_ps(x, x), g));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_mul_ps(_mm_unpackhi_ps(x, x), g));
+	}
+	for (; i < n; i++) {
+		dst[i * 2] = src[i] * gain_l;
+		dst[i * 2 + 1] = src[i] * gain_r;
+	}
+}
+
+// stereo to mono, left + right
+static inline void busk_sum2(float* dst, const float* src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_loadu_ps(src + i * 2);
+		__m128 b = _mm_loadu_ps(src + i * 2 + 4);
+		__m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(dst + i, _mm_add_ps(l, r));
+	}
+	for (; i < n; i++) dst[i] = src[i * 2] + src[i * 2 + 1];
+}
+
+static inline void busk_deinterleave2(float* l, float* r, const float* src, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_loadu_ps(src + i * 2);
+		__m128 b = _mm_loadu_ps(src + i * 2 + 4);
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	for (; i < n; i++) {
+		l[i] = src[i * 2];
+		r[i] = src[i * 2 + 1];
+	}
+}
+
+static inline void busk_interleave2(float* dst, const float* l, const float* r, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_loadu_ps(l + i);
+		__m128 b = _mm_loadu_ps(r + i);
+		_mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(a, b));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(a, b));
+	}
+	for (; i < n; i++) {
+		dst[i * 2] = l[i];
+		dst[i * 2 + 1] = r[i];
+	}
+}
+
+// bus kernels; n is in frames
+
+template <typename BUS>
+static inline void bus_zero(BUS* dst, int n)
+{
+	memset(dst, 0, sizeof(BUS) * n);
+}
+
+// dst = src * gain (dst may be src)
+template <typename BUS>
+static inline void bus_gain(BUS* dst, const BUS* src, typename BUS::T gain, int n)
+{
+	if (BusIsFloat<BUS>::value) {
+		busk_gain((float*)dst, (const float*)src, gain, n * BUS::CH);
+	} else {
+		for (int i = 0; i < n; i++) dst[i] = BUS(src[i]).scale(gain);
+	}
+}
+
+// dst += src * gain
+template <typename BUS>
+static inline void bus_mix(BUS* dst, const BUS* src, typename BUS::T gain, int n)
+{
+	if (BusIsFloat<BUS>::value) {
+		busk_mix((float*)dst, (const float*)src, gain, n * BUS::CH);
+	} else {
+		for (int i = 0; i < n; i++) dst[i] += BUS(src[i]).scale(gain);
+	}
+}
+
+// dst += src * gain, the gain stepping by dgain per frame
+template <typename BUS>
+static inline void bus_mix_ramp(BUS* dst, const BUS* src, typename BUS::T gain, typename BUS::T dgain, int n)
+{
+	if (BusIsFloat<BUS>::value) {
+		busk_mix_ramp((float*)dst, (const float*)src, gain, dgain, BUS::CH, n);
+	} else {
+		for (int i = 0; i < n; i++) {
+			dst[i] += BUS(src[i]).scale(gain);
+			gain += dgain;
+		}
+	}
+}
+
+// mono source onto a stereo bus
+template <typename BUS, typename MONO>
+static inline void bus_pan(BUS* dst, const MONO* src, typename BUS::T gain_l, typename BUS::T gain_r, int n)
+{
+	static_assert(BUS::CH == 2 && MONO::CH == 1, "bus_pan() is mono to stereo");
+	if (BusIsFloat<BUS>::value && BusIsFloat<MONO>::value) {
+		busk_pan((float*)dst, (const float*)src, gain_l, gain_r, n);
+	} else {
+		for (int i = 0; i < n; i++) {
+			dst[i].value[0] = src[i].value[0] * gain_l;
+			dst[i].value[1] = src[i].value[0] * gain_r;
+		}
+	}
+}
+
+// sum of channels, into a mono bus
+template <typename MONO, typename BUS>
+static inline void bus_sum(MONO* dst, const BUS* src, int n)
+{
+	static_assert(MONO::CH == 1, "bus_sum() sums into mono");
+	if (BUS::CH == 2 && BusIsFloat<BUS>::value && BusIsFloat<MONO>::value) {
+		busk_sum2((float*)dst, (const float*)src, n);
+	} else {
+		for (int i = 0; i < n; i++) dst[i].value[0] = BUS(src[i]).sum();
+	}
+}
+
+// interleaved <-> planar; planes[ch] holds n values each
+template <typename BUS>
+static inline void bus_to_planar(typename BUS::T** planes, const BUS* src, int n)
+{
+	if (BUS::CH == 2 && BusIsFloat<BUS>::value) {
+		busk_deinterleave2((float*)planes[0], (float*)planes[1], (const float*)src, n);
+	} else {
+		for (int i = 0; i < n; i++) {
+			for (int c = 0; c < BUS::CH; c++) planes[c][i] = src[i].value[c];
+		}
+	}
+}
+
+template <typename BUS>
+static inline void bus_from_planar(BUS* dst, typename BUS::T* const* planes, int n)
+{
+	if (BUS::CH == 2 && BusIsFloat<BUS>::value) {
+		busk_interleave2((float*)dst, (const float*)planes[0], (const float*)planes[1], n);
+	} else {
+		for (int i = 0; i < n; i++) {
+			for (int c = 0; c < BUS::CH; c++) dst[i].value[c] = planes[c][i];
+		}
+	}
+}
+
+template <typename BUS, int MAX_FRAMES>
+struct BusBuffer {
+	typedef BUS T;
+	typedef typename BUS::T Q;
+
+	BUS* data;
+
+	BusBuffer()
+	{
+		data = (BUS*) aligned_alloc(64, (sizeof(BUS) * MAX_FRAMES + 63) & ~(size_t)63);
+		AN(data);
+		bus_zero(data, MAX_FRAMES);
+	}
+
+	BusBuffer(BusBuffer const&) = delete;
+	void operator=(BusBuffer const&) = delete;
+
+	~BusBuffer()
+	{
+		free(data);
+	}
+
+	inline BUS& operator[](int index)
+	{
+		return data[index];
+	}
+
+	void zero(int n)
+	{
+		bus_zero(data, n);
+	}
+
+	void gain(Q g, int n)
+	{
+		bus_gain(data, data, g, n);
+	}
+
+	void mix(const BUS* src, Q g, int n)
+	{
+		bus_mix(data, src, g, n);
+	}
+
+	void mix_ramp(const BUS* src, Q g, Q dg, int n)
+	{
+		bus_mix_ramp(data, src, g, dg, n);
+	}
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef CALLBACK_STAGE_TIMING
+#include <x86intrin.h>
+#include "assert.h"
+#endif
+
+/*
+audio callback instrumentation. the audio thread brackets every callback with
+begin()/end(); end() measures the wall time against the buffer's budget
+(frames / sample_rate), counts overruns, bins the load into a histogram and
+publishes a snapshot through a seqlock, so a reader thread can read()
+consistent stats at any time without ever blocking the audio thread.
+
+the clock is CLOCK_MONOTONIC through clock_gettime(), which is served from
+the vDSO on linux; the audio thread makes no syscalls.
+
+building with -DCALLBACK_STAGE_TIMING also times individual stages, marked
+with CBS_STAGE() in the DSP code. stages are timed with rdtsc (clock_gettime
+is too slow for per-sample scopes) and reported as shares of the callback
+time; time outside any marked stage shows up as "other". stages may run on
+RenderPool workers too, so every thread adds to counters of its own, which
+end() sums. without the define CBS_STAGE() compiles to nothing.
+*/
+
+enum {
+	CBS_STAGE_DISPATCH = 0, // PQ event callbacks
+	CBS_STAGE_VOICES,       // oscillators, sampler voices
+	CBS_STAGE_FILTER,
+	CBS_STAGE_DECIMATE,     // FirOversampler downsampling
+	CBS_STAGE_COUNT
+};
+
+static inline const char* cbs_stage_name(int stage)
+{
+	static const char* names[CBS_STAGE_COUNT] = { "dispatch", "voices", "filter", "decimate" };
+	return names[stage];
+}
+
+static inline int64_t cbs_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef CALLBACK_STAGE_TIMING
+
+// per thread stage counters. only the owning thread writes a slot (relaxed
+// load + store, no locked add), end() reads them all
+struct CallbackStats_StageTicks {
+	static constexpr int MAX_THREADS = 64;
+
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> ticks[CBS_STAGE_COUNT];
+	};
+
+	Slot slots[MAX_THREADS];
+	std::atomic<int> n_slots;
+
+	static CallbackStats_StageTicks& get_instance()
+	{
+		static CallbackStats_StageTicks instance; // zeroed, being static
+		return instance;
+	}
+
+	// the calling thread's counters, claimed on its first stage
+	static inline std::atomic<uint64_t>* local()
+	{
+		static thread_local std::atomic<uint64_t>* ticks = nullptr;
+		if (ticks == nullptr) {
+			CallbackStats_StageTicks& st = get_instance();
+			int i = st.n_slots.fetch_add(1, std::memory_order_acq_rel);
+			ASSERT(i < MAX_THREADS);
+			ticks = st.slots[i].ticks;
+		}
+		return ticks;
+	}
+
+	void sum(uint64_t* out)
+	{
+		memset(out, 0, sizeof(uint64_t) * CBS_STAGE_COUNT);
+		int n = n_slots.load(std::memory_order_acquire);
+		if (n > MAX_THREADS) n = MAX_THREADS;
+		for (int i = 0; i < n; i++) {
+			for (int s = 0; s < CBS_STAGE_COUNT; s++) {
+				out[s] += slots[i].ticks[s].load(std::memory_order_relaxed);
+			}
+		}
+	}
+};
+
+struct CallbackStats_StageTimer {
+	int stage;
+	uint64_t t0;
+
+	CallbackStats_StageTimer(int stage) : stage(stage), t0(__rdtsc()) {}
+
+	~CallbackStats_StageTimer()
+	{
+		std::atomic<uint64_t>& ticks = CallbackStats_StageTicks::local()[stage];
+		ticks.store(ticks.load(std::memory_order_relaxed) + (__rdtsc() - t0), std::memory_order_relaxed);
+	}
+};
+
+#define CBS_STAGE(stage) CallbackStats_StageTimer _cbs_stage_timer(stage)
+
+#else
+
+#define CBS_STAGE(stage)
+
+#endif
+
+struct CallbackStats_Snapshot {
+	// 5% of the budget per bucket; the last one holds everything >= 200%
+	static constexpr int HISTOGRAM_BUCKETS = 41;
+	static constexpr int HISTOGRAM_PERCENT = 5;
+
+	uint64_t callbacks;
+	uint64_t overruns;
+	uint64_t frames;
+	int64_t total_ns;
+	int64_t total_budget_ns;
+	int64_t max_ns;
+	int64_t last_ns;
+	int64_t budget_ns;     // of the last callback
+	double max_load;       // callback time / budget
+	uint64_t histogram[HISTOGRAM_BUCKETS];
+	uint64_t callback_ticks;
+	uint64_t stage_ticks[CBS_STAGE_COUNT];
+
+	// load (callback time / budget) at percentile p (0..1), bucket resolution
+	double load_percentile(double p)
+	{
+		if (callbacks == 0) return 0.0;
+		uint64_t target = (uint64_t)(p * (double)callbacks);
+		uint64_t n = 0;
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			n += histogram[i];
+			if (n > target) return (double)((i + 1) * HISTOGRAM_PERCENT) / 100.0;
+		}
+		return max_load;
+	}
+
+	// share of the callback time spent in a stage (stage timing builds only)
+	double stage_share(int stage)
+	{
+		if (callback_ticks == 0) return 0.0;
+		return (double)stage_ticks[stage] / (double)callback_ticks;
+	}
+
+	void print(FILE* f, const char* prefix)
+	{
+		fprintf(f, "%scallbacks %llu  load avg %.1f%% p50 %.0f%% p99 %.0f%% max %.1f%%  overruns %llu",
+			prefix,
+			(unsigned long long)callbacks,
+			total_budget_ns > 0 ? 100.0 * (double)total_ns / (double)total_budget_ns : 0.0,
+			100.0 * load_percentile(0.5),
+			100.0 * load_percentile(0.99),
+			100.0 * max_load,
+			(unsigned long long)overruns);
+		if (callback_ticks > 0) {
+			double other = 1.0;
+			fprintf(f, "  stages");
+			for (int s = 0; s < CBS_STAGE_COUNT; s++) {
+				fprintf(f, " %s %.1f%%", cbs_stage_name(s), 100.0 * stage_share(s));
+				other -= stage_share(s);
+			}
+			fprintf(f, " other %.1f%%", 100.0 * other);
+		}
+		fprintf(f, "\n");
+	}
+};
+
+struct CallbackStats {
+	std::atomic<uint32_t> seq{0};
+	CallbackStats_Snapshot published;
+
+	// audio thread only
+	CallbackStats_Snapshot live;
+	int64_t t0;
+	uint64_t t0_ticks;
+
+	CallbackStats()
+	{
+		memset(&live, 0, sizeof(live));
+		memset(&published, 0, sizeof(published));
+	}
+
+	CallbackStats(CallbackStats const&) = delete;
+	void operator=(CallbackStats const&) = delete;
+
+	inline void begin()
+	{
+		t0 = cbs_now_ns();
+		#ifdef CALLBACK_STAGE_TIMING
+		t0_ticks = __rdtsc();
+		#endif
+	}
+
+	inline void end(int frames, float sample_rate)
+	{
+		int64_t ns = cbs_now_ns() - t0;
+		int64_t budget_ns = (int64_t)((double)frames * 1e9 / (double)sample_rate);
+
+		live.callbacks++;
+		live.frames += frames;
+		live.total_ns += ns;
+		live.total_budget_ns += budget_ns;
+		live.last_ns = ns;
+		live.budget_ns = budget_ns;
+		if (ns > live.max_ns) live.max_ns = ns;
+		if (ns > budget_ns) live.overruns++;
+
+		double load = budget_ns > 0 ? (double)ns / (double)budget_ns : 0.0;
+		if (load > live.max_load) live.max_load = load;
+		int bucket = (int)(load * (100.0 / (double)CallbackStats_Snapshot::HISTOGRAM_PERCENT));
+		if (bucket >= CallbackStats_Snapshot::HISTOGRAM_BUCKETS) bucket = CallbackStats_Snapshot::HISTOGRAM_BUCKETS - 1;
+		live.histogram[bucket]++;
+
+		#ifdef CALLBACK_STAGE_TIMING
+		live.callback_ticks += __rdtsc() - t0_ticks;
+		CallbackStats_StageTicks::get_instance().sum(live.stage_ticks);
+		#endif
+
+		publish();
+	}
+
+	// seqlock write; odd sequence numbers mean a write is in progress
+	void publish()
+	{
+		uint32_t s = seq.load(std::memory_order_relaxed);
+		seq.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(&published, &live, sizeof(live));
+		seq.store(s + 2, std::memory_order_release);
+	}
+
+	// any thread; retries until it gets a snapshot no write overlapped
+	void read(CallbackStats_Snapshot* out)
+	{
+		while (true) {
+			uint32_t s0 = seq.load(std::memory_order_acquire);
+			if (s0 & 1) continue;
+			memcpy(out, &published, sizeof(*out));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			uint32_t s1 = seq.load(std::memory_order_relaxed);
+			if (s0 == s1) return;
+		}
+	}
+};
@@ -0,0 +1,418 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "Bus.h"
+#include "FFT.h"
+#include "Smpl.h"
+#include "SmplBx.h"
+#include "Trace.h"
+#include "assert.h"
+
+/*
+convolution reverb: partitioned FFT convolution (overlap-save) of a BUS
+signal with an impulse response loaded through SmplBx, channel by channel.
+
+partitioning is non-uniform. stage 0 runs blocks of head_block frames; each
+following stage runs blocks 4x the size of the previous, up to max_block. a
+stage with block size B has B frames of latency, so it starts B - head_block
+frames into the impulse response, which brings every stage into line with
+the head_block latency of stage 0. with ratio 4 each stage but the last
+covers 3 partitions, and the last one covers whatever is left; long tails
+thus go through a few big FFTs instead of many small ones.
+
+a stage does all its work when its block fills up, so bigger stages make for
+uneven per-callback cost; keep max_block within what a callback can afford.
+
+the partition spectra are computed once and cached next to the SmplBx cache
+of the impulse response (.conv<head_block>x<max_block>), keyed on the same
+source identity.
+*/
+
+struct Convolver_CacheHeader {
+	static constexpr size_t SIZE = 128;
+	static constexpr uint32_t VERSION = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+
+	// identity of the impulse response, copied from its SmplBx header
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint64_t src_hash;
+	uint32_t target_rate;
+
+	// layout
+	uint32_t num_channels;
+	uint32_t value_size;
+	uint32_t head_block;
+	uint32_t max_block;
+	uint64_t ir_frames;
+	uint64_t spectra_size;
+
+	static const char* get_magic()
+	{
+		return "SMPLCNV\x1a";
+	}
+
+	void init(SmplBx_CacheHeader* ir, uint32_t ch, uint32_t vsz, uint32_t head, uint32_t max, uint64_t frames, uint64_t sz)
+	{
+		memset(this, 0, sizeof(*this));
+		memcpy(magic, get_magic(), sizeof(magic));
+		version = VERSION;
+		header_size = SIZE;
+		src_size = ir->src_size;
+		src_mtime_sec = ir->src_mtime_sec;
+		src_mtime_nsec = ir->src_mtime_nsec;
+		src_hash = ir->src_hash;
+		target_rate = ir->target_rate;
+		num_channels = ch;
+		value_size = vsz;
+		head_block = head;
+		max_block = max;
+		ir_frames = frames;
+		spectra_size = sz;
+	}
+
+	bool matches(Convolver_CacheHeader* other)
+	{
+		return memcmp(this, other, sizeof(*this)) == 0;
+	}
+};
+
+static_assert(sizeof(Convolver_CacheHeader) <= Convolver_CacheHeader::SIZE, "Convolver_CacheHeader does not fit");
+
+
+template <typename BUS>
+struct Convolver {
+	static constexpr int MAX_STAGES = 16;
+	static constexpr int STAGE_RATIO = 4;
+
+	typedef BUS T;
+	typedef typename BUS::T Q;
+	static constexpr int CH = BUS::CH;
+
+	struct Stage {
+		int block;
+		int offset;
+		int parts;
+		int bins;       // complex bins per spectrum
+		FFT<Q>* fft;
+		Q* spectra;     // [parts][CH][bins*2], scaled for inverse_unscaled()
+		Q* fdl;         // [parts][CH][bins*2], frequency domain delay line
+		int fdl_pos;
+		Q* in;          // [CH][block*2]
+		Q* out;         // [CH][block]
+		Q* acc;         // [bins*2]
+		Q* tmp;         // [block*2]
+		int fill;
+
+		Q* spectrum(Q* base, int part, int ch)
+		{
+			return base + ((size_t)part * CH + ch) * bins * 2;
+		}
+	};
+
+	Smpl<BUS>* ir = nullptr;
+	int head_block;
+	int max_block;
+	int n_stages = 0;
+	Stage stages[MAX_STAGES];
+	void* cache_ptr = MAP_FAILED;
+	size_t cache_size = 0;
+
+	Convolver() {}
+	Convolver(Convolver<BUS> const&) = delete;
+	void operator=(Convolver<BUS> const&) = delete;
+
+	~Convolver()
+	{
+		for (int s = 0; s < n_stages; s++) {
+			Stage& st = stages[s];
+			delete st.fft;
+			free(st.fdl);
+			free(st.in);
+			free(st.out);
+			free(st.acc);
+			free(st.tmp);
+		}
+		if (cache_ptr != MAP_FAILED) {
+			AZ(munmap(cache_ptr, cache_size));
+		}
+	}
+
+	void _plan(uint64_t ir_frames)
+	{
+		n_stages = 0;
+		int block = head_block;
+		uint64_t offset = 0;
+		while (offset < ir_frames) {
+			ASSERT(n_stages < MAX_STAGES);
+			Stage& st = stages[n_stages++];
+			int next_block = block * STAGE_RATIO;
+			bool last = next_block > max_block;
+			uint64_t end = last ? ir_frames : (uint64_t)(next_block - head_block);
+			if (end > ir_frames) end = ir_frames;
+			st.block = block;
+			st.offset = offset;
+			st.parts = (end - offset + block - 1) / block;
+			st.bins = block + 1;
+			if (last) break;
+			offset = end;
+			block = next_block;
+		}
+	}
+
+	size_t _spectra_size()
+	{
+		size_t sz = 0;
+		for (int s = 0; s < n_stages; s++) {
+			sz += (size_t)stages[s].parts * CH * stages[s].bins * 2;
+		}
+		return sz;
+	}
+
+	void _compute_spectra(Q* spectra)
+	{
+		for (int s = 0; s < n_stages; s++) {
+			Stage& st = stages[s];
+			FFT<Q> fft(st.block * 2);
+			Q* x = (Q*) malloc(sizeof(Q) * st.block * 2);
+			AN(x);
+			const Q scale = (Q)1 / (Q)st.block;
+			for (int p = 0; p < st.parts; p++) {
+				for (int ch = 0; ch < CH; ch++) {
+					memset(x, 0, sizeof(Q) * st.block * 2);
+					for (int i = 0; i < st.block; i++) {
+						int64_t j = (int64_t)st.offset + (int64_t)p * st.block + i;
+						x[i] = (*ir)[j][ch];
+					}
+					Q* H = st.spectrum(spectra, p, ch);
+					fft.forward(x, H);
+					for (int k = 0; k < st.bins * 2; k++) {
+						H[k] *= scale;
+					}
+				}
+			}
+			free(x);
+			spectra += (size_t)st.parts * CH * st.bins * 2;
+		}
+	}
+
+	// maps a valid spectra cache, or returns nullptr
+	Q* _load_cache(const std::string& path, Convolver_CacheHeader* expected)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			if (errno != ENOENT) {
+				arghf("%s: %s", path.c_str(), strerror(errno));
+			}
+			return nullptr;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			arghf("fstat: %s: %s", path.c_str(), strerror(errno));
+		}
+
+		size_t sz = Convolver_CacheHeader::SIZE + expected->spectra_size * sizeof(Q);
+		if ((size_t)st.st_size != sz) {
+			AZ(close(fd));
+			return nullptr;
+		}
+
+		void* ptr = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			arghf("mmap: %s: %s", path.c_str(), strerror(errno));
+		}
+		AZ(close(fd));
+
+		if (!expected->matches((Convolver_CacheHeader*) ptr)) {
+			AZ(munmap(ptr, sz));
+			return nullptr;
+		}
+
+		cache_ptr = ptr;
+		cache_size = sz;
+		return (Q*) ((char*)ptr + Convolver_CacheHeader::SIZE);
+	}
+
+	Q* _build_cache(const std::string& path, Convolver_CacheHeader* hdr)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), ".tmp%d", (int)getpid());
+		std::string tmp_path = path + std::string(buf);
+
+		int fd = open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (fd == -1) {
+			arghf("%s: %s", tmp_path.c_str(), strerror(errno));
+		}
+
+		size_t sz = Convolver_CacheHeader::SIZE + hdr->spectra_size * sizeof(Q);
+		if (ftruncate(fd, sz) == -1) {
+			arghf("%s: %s", tmp_path.c_str(), strerror(errno));
+		}
+
+		void* ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			arghf("mmap: %s: %s", tmp_path.c_str(), strerror(errno));
+		}
+		AZ(close(fd));
+
+		Q* spectra = (Q*) ((char*)ptr + Convolver_CacheHeader::SIZE);
+		_compute_spectra(spectra);
+		// spectra, then header, each synced before the next step (see
+		// SmplBx::build_cache())
+		if (msync(ptr, sz, MS_SYNC) == -1) {
+			arghf("msync: %s: %s", tmp_path.c_str(), strerror(errno));
+		}
+		memcpy(ptr, hdr, sizeof(*hdr));
+		if (msync(ptr, Convolver_CacheHeader::SIZE, MS_SYNC) == -1) {
+			arghf("msync: %s: %s", tmp_path.c_str(), strerror(errno));
+		}
+
+		if (rename(tmp_path.c_str(), path.c_str()) == -1) {
+			int e = errno;
+			unlink(tmp_path.c_str());
+			arghf("rename %s: %s", path.c_str(), strerror(e));
+		}
+
+		cache_ptr = ptr;
+		cache_size = sz;
+		return spectra;
+	}
+
+	// loads the impulse response at path, resampled to sample_rate
+	void load(SmplBx& smplbx, const char* path, uint32_t sample_rate, int head_block_ = 256, int max_block_ = 16384)
+	{
+		ASSERT(ir == nullptr);
+		ASSERT((head_block_ & (head_block_ - 1)) == 0 && head_block_ >= 4);
+		head_block = head_block_;
+		max_block = max_block_ < head_block_ ? head_block_ : max_block_;
+
+		ir = smplbx.load<BUS>(path, sample_rate);
+		_plan(ir->frames);
+
+		Convolver_CacheHeader hdr;
+		hdr.init(SmplBx::get_header(ir), CH, sizeof(Q), head_block, max_block, ir->frames, _spectra_size());
+
+		char buf[64];
+		snprintf(buf, sizeof(buf), ".conv%dx%d", head_block, max_block);
+		std::string cache_path = smplbx.get_cache_path<BUS>(path, sample_rate) + std::string(buf);
+
+		Q* spectra = _load_cache(cache_path, &hdr);
+		if (spectra == nullptr) {
+			spectra = _build_cache(cache_path, &hdr);
+		}
+
+		for (int s = 0; s < n_stages; s++) {
+			Stage& st = stages[s];
+			st.spectra = spectra;
+			spectra += (size_t)st.parts * CH * st.bins * 2;
+
+			st.fft = new FFT<Q>(st.block * 2);
+			st.fdl = (Q*) calloc((size_t)st.parts * CH * st.bins * 2, sizeof(Q));
+			st.fdl_pos = 0;
+			st.in = (Q*) calloc((size_t)CH * st.block * 2, sizeof(Q));
+			st.out = (Q*) calloc((size_t)CH * st.block, sizeof(Q));
+			st.acc = (Q*) malloc(sizeof(Q) * st.bins * 2);
+			st.tmp = (Q*) malloc(sizeof(Q) * st.block * 2);
+			st.fill = 0;
+			AN(st.fdl); AN(st.in); AN(st.out); AN(st.acc); AN(st.tmp);
+		}
+	}
+
+	// latency in frames between process() input and output
+	int get_latency()
+	{
+		return head_block;
+	}
+
+	void _compute(Stage& st)
+	{
+		TRACE_SCOPE("convolver stage");
+		const int nq = st.bins * 2;
+		for (int ch = 0; ch < CH; ch++) {
+			Q* in = st.in + (size_t)ch * st.block * 2;
+			st.fft->forward(in, st.spectrum(st.fdl, st.fdl_pos, ch));
+
+			memset(st.acc, 0, sizeof(Q) * nq);
+			for (int p = 0; p < st.parts; p++) {
+				int slot = st.fdl_pos - p;
+				if (slot < 0) slot += st.parts;
+				const Q* H = st.spectrum(st.spectra, p, ch);
+				const Q* X = st.spectrum(st.fdl, slot, ch);
+				Q* acc = st.acc;
+				for (int k = 0; k < nq; k += 2) {
+					acc[k] += H[k] * X[k] - H[k+1] * X[k+1];
+					acc[k+1] += H[k] * X[k+1] + H[k+1] * X[k];
+				}
+			}
+
+			st.fft->inverse_unscaled(st.acc, st.tmp);
+			memcpy(st.out + (size_t)ch * st.block, st.tmp + st.block, sizeof(Q) * st.block);
+			memmove(in, in + st.block, sizeof(Q) * st.block);
+		}
+		st.fdl_pos++;
+		if (st.fdl_pos == st.parts) st.fdl_pos = 0;
+	}
+
+	void _process_stage(Stage& st, const BUS* input, BUS* output, int n)
+	{
+		int i = 0;
+		while (i < n) {
+			int m = st.block - st.fill;
+			if (m > (n - i)) m = n - i;
+			for (int ch = 0; ch < CH; ch++) {
+				Q* in = st.in + (size_t)ch * st.block * 2 + st.block + st.fill;
+				const Q* out = st.out + (size_t)ch * st.block + st.fill;
+				for (int j = 0; j < m; j++) {
+					in[j] = input[i + j].value[ch];
+					output[i + j].value[ch] += out[j];
+				}
+			}
+			st.fill += m;
+			i += m;
+			if (st.fill == st.block) {
+				_compute(st);
+				st.fill = 0;
+			}
+		}
+	}
+
+	// convolves n frames of input into output (wet only), delayed by
+	// get_latency() frames. input and output may be the same buffer
+	void process(const BUS* input, BUS* output, int n)
+	{
+		ASSERT(ir != nullptr);
+		if (input == output) {
+			// every stage reads the input, so it can't be overwritten
+			// until the last one is done; go through a copy
+			BUS chunk[256];
+			for (int offset = 0; offset < n; offset += 256) {
+				int m = (n - offset) < 256 ? (n - offset) : 256;
+				memcpy(chunk, input + offset, sizeof(BUS) * m);
+				process(chunk, output + offset, m);
+			}
+			return;
+		}
+
+		TRACE_SCOPE("convolver");
+		memset(output, 0, sizeof(BUS) * n);
+		for (int s = 0; s < n_stages; s++) {
+			_process_stage(stages[s], input, output, n);
+		}
+	}
+};
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <immintrin.h>
+
+/*
+hot flat kernels, compiled for several instruction sets in the same binary
+(with target attributes, so the rest of the build stays at -msse) and picked
+once, on first use, from what cpuid reports:
+
+  sse2    baseline; every x86-64 has it
+  avx2    AVX2 + FMA + F16C
+  avx512  AVX-512F (+ AVX2, FMA, F16C)
+
+DSP_ISA=<name> in the environment forces a variant (if the CPU has it), for
+comparisons. components fetch dsp_get_kernels() once, like tables, and call
+through the pointers; dsp_get_isa() tells which variant is in use.
+
+kernels:
+
+  macc(out, x, h, count, ch): out[c] = sum of x[i]*h[i] over i = c (mod ch),
+  i.e. ch interleaved dot products; ch is 1, 2 or 4. FirOversampler runs its
+  decimation FIR through this (via dsp_macc(), which keeps short ones on sse2)
+  unless the ratio is 2.
+
+  s16_to_f32(dst, src, n): PCM to float, scaled by 1/32768
+
+  f16_to_f32(dst, src, n): half floats (as bits) to float. sse2 rebiases
+  the exponent with integer ops and converts subnormal halves from their
+  mantissa, so no float denormal is ever made (DAZ can't flush them); inf
+  and nan come out as large finite values there. the others use F16C
+
+  f32_to_s16(dst, src, n): float to PCM, clamped to [-1;1], scaled by 32767
+  and rounded to nearest; returns the number of samples that were clamped
+*/
+
+struct DspKernels {
+	const char* isa;
+	void (*macc)(float* out, const float* x, const float* h, int count, int ch);
+	void (*s16_to_f32)(float* dst, const int16_t* src, size_t n);
+	void (*f16_to_f32)(float* dst, const uint16_t* src, size_t n);
+	size_t (*f32_to_s16)(int16_t* dst, const float* src, size_t n);
+};
+
+// four lanes of partial sums (lane l belongs to channel l % ch) plus the
+// scalar tail from i on; i is a multiple of 4, so the tail starts at channel 0.
+// always inlined: called out of line from the avx kernels, it would run
+// legacy SSE code with the upper halves still dirty (no vzeroupper on a tail
+// call), which stalls every SSE instruction after it
+__attribute__((always_inline))
+static inline void _dsp_macc_finish(float* out, __m128 acc, const float* x, const float* h, int i, int count, int ch)
+{
+	float l[4];
+	_mm_storeu_ps(l, acc);
+	if (ch == 1) {
+		out[0] = (l[0] + l[1]) + (l[2] + l[3]);
+	} else if (ch == 2) {
+		out[0] = l[0] + l[2];
+		out[1] = l[1] + l[3];
+	} else {
+		for (int c = 0; c < 4; c++) out[c] = l[c];
+	}
+	for (int c = 0; i < count; i++) {
+		out[c] += x[i] * h[i];
+		if (++c == ch) c = 0;
+	}
+}
+
+static inline float _dsp_f16_to_f32(uint16_t h)
+{
+	const uint32_t m = h & 0x7fff;
+	union {
+		float f;
+		uint32_t u;
+	} r;
+	if (m < 0x400) {
+		r.f = (float)m * 5.9604645e-8f; // 2^-24
+	} else {
+		r.u = (m << 13) + ((uint32_t)(127 - 15) << 23);
+	}
+	r.u |= (uint32_t)(h & 0x8000) << 16;
+	return r.f;
+}
+
+static inline size_t _dsp_clamp_s16(int16_t* dst, const float* src, size_t i, size_t n)
+{
+	size_t clipped = 0;
+	for (; i < n; i++) {
+		float v = src[i];
+		if (v > 1.0f) {
+			v = 1.0f;
+			clipped++;
+		} else if (v < -1.0f) {
+			v = -1.0f;
+			clipped++;
+		}
+		dst[i] = (int16_t)lrintf(v * 32767.0f);
+	}
+	return clipped;
+}
+
+// sse2
+
+static void dsp_macc_sse2(float* out, const float* x, const float* h, int count, int ch)
+{
+	__m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+		a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(h + i + 4)));
+	}
+	for (; i + 4 <= count; i += 4) {
+		a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+	}
+	_dsp_macc_finish(out, _mm_add_ps(a0, a1), x, h, i, count, ch);
+}
+
+static void dsp_s16_to_f32_sse2(float* dst, const int16_t* src, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	for (; i < n; i++) dst[i] = (float)src[i] / 32768.0f;
+}
+
+static inline __m128 _dsp_f16_to_f32_sse2(__m128i h)
+{
+	const __m128i m = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+	const __m128i sign = _mm_slli_epi32(_mm_xor_si128(h, m), 16);
+	const __m128 normal = _mm_castsi128_ps(_mm_add_epi32(_mm_slli_epi32(m, 13), _mm_set1_epi32((127 - 15) << 23)));
+	const __m128 sub = _mm_mul_ps(_mm_cvtepi32_ps(m), _mm_set1_ps(5.9604645e-8f)); // 2^-24
+	const __m128 is_sub = _mm_castsi128_ps(_mm_cmplt_epi32(m, _mm_set1_epi32(0x400)));
+	const __m128 r = _mm_or_ps(_mm_and_ps(is_sub, sub), _mm_andnot_ps(is_sub, normal));
+	return _mm_or_ps(r, _mm_castsi128_ps(sign));
+}
+
+static void dsp_f16_to_f32_sse2(float* dst, const uint16_t* src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_ps(dst + i, _dsp_f16_to_f32_sse2(_mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_ps(dst + i + 4, _dsp_f16_to_f32_sse2(_mm_unpackhi_epi16(v, zero)));
+	}
+	for (; i < n; i++) dst[i] = _dsp_f16_to_f32(src[i]);
+}
+
+static size_t dsp_f32_to_s16_sse2(int16_t* dst, const float* src, size_t n)
+{
+	const __m128 one = _mm_set1_ps(1.0f), mone = _mm_set1_ps(-1.0f), scale = _mm_set1_ps(32767.0f);
+	size_t clipped = 0;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_loadu_ps(src + i);
+		__m128 b = _mm_loadu_ps(src + i + 4);
+		int m = _mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(a, one), _mm_cmplt_ps(a, mone)));
+		m |= _mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(b, one), _mm_cmplt_ps(b, mone))) << 4;
+		clipped += __builtin_popcount(m);
+		a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(a, mone), one), scale);
+		b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(b, mone), one), scale);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+	return clipped + _dsp_clamp_s16(dst, src, i, n);
+}
+
+// avx2
+
+__attribute__((target("avx2,fma")))
+static void dsp_macc_avx2(float* out, const float* x, const float* h, int count, int ch)
+{
+	__m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		a0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(h + i), a0);
+		a1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(h + i + 8), a1);
+	}
+	for (; i + 8 <= count; i += 8) {
+		a0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(h + i), a0);
+	}
+	a0 = _mm256_add_ps(a0, a1);
+	// halves fold onto each other lane for lane; 4 is a multiple of ch
+	__m128 a = _mm_add_ps(_mm256_castps256_ps128(a0), _mm256_extractf128_ps(a0, 1));
+	for (; i + 4 <= count; i += 4) {
+		a = _mm_fmadd_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i), a);
+	}
+	_dsp_macc_finish(out, a, x, h, i, count, ch);
+}
+
+__attribute__((target("avx2,fma")))
+static void dsp_s16_to_f32_avx2(float* dst, const int16_t* src, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	for (; i < n; i++) dst[i] = (float)src[i] / 32768.0f;
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void dsp_f16_to_f32_avx2(float* dst, const uint16_t* src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+		_mm256_storeu_ps(dst + i + 8, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i + 8))));
+	}
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+	}
+	for (; i < n; i++) dst[i] = _mm_cvtss_f32(_mm_cvtph_ps(_mm_cvtsi32_si128(src[i])));
+}
+
+__attribute__((target("avx2,fma")))
+static size_t dsp_f32_to_s16_avx2(int16_t* dst, const float* src, size_t n)
+{
+	const __m256 one = _mm256_set1_ps(1.0f), mone = _mm256_set1_ps(-1.0f), scale = _mm256_set1_ps(32767.0f);
+	size_t clipped = 0;
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_loadu_ps(src + i);
+		__m256 b = _mm256_loadu_ps(src + i + 8);
+		int m = _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(a, one, _CMP_GT_OQ), _mm256_cmp_ps(a, mone, _CMP_LT_OQ)));
+		m |= _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(b, one, _CMP_GT_OQ), _mm256_cmp_ps(b, mone, _CMP_LT_OQ))) << 8;
+		clipped += __builtin_popcount(m);
+		a = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(a, mone), one), scale);
+		b = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(b, mone), one), scale);
+		// packs works within 128-bit lanes; put the quads back in order
+		__m256i p = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	return clipped + _dsp_clamp_s16(dst, src, i, n);
+}
+
+// avx512 (gcc 12 warns about its own _mm512_undefined_*() in these)
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f,avx2,fma")))
+static void dsp_macc_avx512(float* out, const float* x, const float* h, int count, int ch)
+{
+	__m512 a0 = _mm512_setzero_ps();
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		a0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(h + i), a0);
+	}
+	__m256 b = _mm256_add_ps(_mm512_castps512_ps256(a0), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a0), 1)));
+	for (; i + 8 <= count; i += 8) {
+		b = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(h + i), b);
+	}
+	__m128 a = _mm_add_ps(_mm256_castps256_ps128(b), _mm256_extractf128_ps(b, 1));
+	for (; i + 4 <= count; i += 4) {
+		a = _mm_fmadd_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i), a);
+	}
+	_dsp_macc_finish(out, a, x, h, i, count, ch);
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static void dsp_s16_to_f32_avx512(float* dst, const int16_t* src, size_t n)
+{
+	const __m512 scale = _mm512_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512i v = _mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i*)(src + i)));
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale));
+	}
+	for (; i < n; i++) dst[i] = (float)src[i] / 32768.0f;
+}
+
+__attribute__((target("avx512f,avx2,fma,f16c")))
+static void dsp_f16_to_f32_avx512(float* dst, const uint16_t* src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		_mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(src + i))));
+	}
+	for (; i < n; i++) dst[i] = _mm_cvtss_f32(_mm_cvtph_ps(_mm_cvtsi32_si128(src[i])));
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+static size_t dsp_f32_to_s16_avx512(int16_t* dst, const float* src, size_t n)
+{
+	const __m512 one = _mm512_set1_ps(1.0f), mone = _mm512_set1_ps(-1.0f), scale = _mm512_set1_ps(32767.0f);
+	size_t clipped = 0;
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512 a = _mm512_loadu_ps(src + i);
+		__mmask16 m = _mm512_cmp_ps_mask(a, one, _CMP_GT_OQ) | _mm512_cmp_ps_mask(a, mone, _CMP_LT_OQ);
+		clipped += __builtin_popcount(m);
+		a = _mm512_mul_ps(_mm512_min_ps(_mm512_max_ps(a, mone), one), scale);
+		// saturating narrow; values are in range already
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm512_cvtsepi32_epi16(_mm512_cvtps_epi32(a)));
+	}
+	return clipped + _dsp_clamp_s16(dst, src, i, n);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+static DspKernels dsp_select_kernels()
+{
+	static const DspKernels variants[] = {
+		{ "avx512", dsp_macc_avx512, dsp_s16_to_f32_avx512, dsp_f16_to_f32_avx512, dsp_f32_to_s16_avx512 },
+		{ "avx2", dsp_macc_avx2, dsp_s16_to_f32_avx2, dsp_f16_to_f32_avx2, dsp_f32_to_s16_avx2 },
+		{ "sse2", dsp_macc_sse2, dsp_s16_to_f32_sse2, dsp_f16_to_f32_sse2, dsp_f32_to_s16_sse2 },
+	};
+	__builtin_cpu_init();
+	const bool supported[] = {
+		__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"),
+		__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"),
+		true,
+	};
+	const char* force = getenv("DSP_ISA");
+	for (int i = 0; i < 3; i++) {
+		if (!supported[i]) continue;
+		if (force != nullptr && strcmp(force, variants[i].isa) != 0) continue;
+		return variants[i];
+	}
+	if (force != nullptr) fprintf(stderr, "DSP_ISA=%s not supported here; using sse2\n", force);
+	return variants[2];
+}
+
+static inline const DspKernels* dsp_get_kernels()
+{
+	static const DspKernels kernels = dsp_select_kernels();
+	return &kernels;
+}
+
+/*
+macc() for the call sites, with the variant picked by length: up to
+DSP_MACC_INLINE_MAX products the sse2 kernel is called directly (and
+inlines), since there the indirect call and the wider kernels' setup and
+reductions cost more than their lanes save. a RATIO 4 FirOversampler (65
+taps) takes 21ns per output that way, against 29ns through avx512; from
+RATIO 8 (129 taps) on, avx512 wins.
+*/
+static constexpr int DSP_MACC_INLINE_MAX = 96;
+
+static inline void dsp_macc(const DspKernels* dsp, float* out, const float* x, const float* h, int count, int ch)
+{
+	if (count <= DSP_MACC_INLINE_MAX) {
+		dsp_macc_sse2(out, x, h, count, ch);
+	} else {
+		dsp->macc(out, x, h, count, ch);
+	}
+}
+
+static inline const char* dsp_get_isa()
+{
+	return dsp_get_kernels()->isa;
+}
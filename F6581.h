@@ -1,6 +1,12 @@
 #pragma once
 
 #include <math.h>
+#include <emmintrin.h>
+
+#include "Math.h"
+#include "Mod.h"
+#include "Quality.h"
+#include "assert.h"
 
 struct F6581Params {
 	//static constexpr float MAP_NEG() { return 293760.0f; }
@@ -32,12 +38,32 @@ struct F6581 {
 	float vlp, vbp, vhp;
 
 	float distortion_ct;
+	// the integrators' per-sample rate; DISTORTION_CF_THRESHOLD is tuned
+	// for the first sample rate set, later changes scale it to keep the
+	// response
+	float cf = PARAMS::DISTORTION_CF_THRESHOLD();
+	int _sample_rate = 0;
 	float fc_exp;
 	float fc_distortion_offset;
 	float rq;
+	// below QUALITY_HIGH, e^x in distortion() is fast_exp2f(x * log2(e));
+	// its error is well below the FET model's own, so switching needs no
+	// crossfade
+	bool fast_exp = false;
+
+	/*
+	PARAMS whose map() takes silence to zero let the integrators decay into
+	denormal range. sample() adds DENORMAL_GUARD to them and takes it away
+	again, which flushes anything below ~1e-25 to zero without a branch, and
+	leaves anything above ~2e-11 exactly as it was (F6581Params keeps the
+	state around 1e6, so that's bit for bit)
+	*/
+	static constexpr float DENORMAL_GUARD = 1e-18f;
 
 	void set_sample_rate(int sample_rate)
 	{
+		if (_sample_rate > 0) cf *= (float)_sample_rate / (float)sample_rate;
+		_sample_rate = sample_rate;
 		distortion_ct = 1.0f / (PARAMS::SIDCAPS() * (float)sample_rate);
 	}
 
@@ -56,7 +82,8 @@ struct F6581 {
 		float dist = input - fc_distortion_offset;
 		float fet_resistance = fc_exp;
 		if(dist > 0.0f) {
-			fet_resistance *= expf(dist * PARAMS::LOG_STEEPNESS()); // XXX slow?
+			const float x = dist * PARAMS::LOG_STEEPNESS();
+			fet_resistance *= fast_exp ? fast_exp2f(x * 1.44269504f) : expf(x);
 		}
 		float dynamic_resistance = PARAMS::MIN_FET_RESISTANCE() + fet_resistance;
 		float one_div_resistance = (PARAMS::BASE_RESISTANCE() + dynamic_resistance) / (PARAMS::BASE_RESISTANCE() * dynamic_resistance);
@@ -77,19 +104,26 @@ struct F6581 {
 		}
 
 		vf -= (vi * PARAMS::DISTORTION_RATE() + vhp + vlp - vbp * rq) * 0.5f * bandpass_gain;
-		vbp += (vf - vbp) * PARAMS::DISTORTION_CF_THRESHOLD() * bandpass_gain;
-		vlp += (vf - vlp) * PARAMS::DISTORTION_CF_THRESHOLD() * lowpass_gain;
-		vhp += (vf - vhp) * PARAMS::DISTORTION_CF_THRESHOLD() * highpass_gain;
+		vbp += (vf - vbp) * cf * bandpass_gain;
+		vlp += (vf - vlp) * cf * lowpass_gain;
+		vhp += (vf - vhp) * cf * highpass_gain;
 		vlp -= vbp * distortion(vbp) * PARAMS::OUTPUT_DIFFERENCE();
 		vbp -= vhp * distortion(vhp);
 		vhp = vbp * rq - (vlp * (1.0f / PARAMS::OUTPUT_DIFFERENCE())) - vi * PARAMS::DISTORTION_RATE();
+		vlp += DENORMAL_GUARD;
+		vlp -= DENORMAL_GUARD;
+		vbp += DENORMAL_GUARD;
+		vbp -= DENORMAL_GUARD;
+		vhp += DENORMAL_GUARD;
+		vhp -= DENORMAL_GUARD;
 
 		return unmap(vf);
 	}
 
 	void fc_update()
 	{
-		fc_exp = PARAMS::OFFSET() * expf(fc * PARAMS::LOG_STEEPNESS() * 256.0f);
+		// e^(fc * ln(1/STEEPNESS)), as a power of two
+		fc_exp = PARAMS::OFFSET() * fast_exp2f(fc * -log2f(PARAMS::STEEPNESS()));
 		fc_distortion_offset = (PARAMS::DISTORTION_POINT() - fc) * 256.0f * PARAMS::DISTORTION_RATE();
 	}
 
@@ -98,6 +132,100 @@ struct F6581 {
 		rq = 1.0f / (0.707f + q);
 	}
 
+	/*
+	audio-rate fc and q (see Mod.h): for the next n output frames, one fc
+	and one q per frame, either of them null to leave it alone. they're
+	turned into what fc_update() and q_update() would make of them (bit
+	for bit) four at a time, and next_frame() applies a frame's worth.
+	afterwards the last values hold, as if set. min_sample_rate() goes by
+	the highest of the block
+	*/
+	float _mod_fc_exp[MOD_BLOCK];
+	float _mod_fc_offset[MOD_BLOCK];
+	float _mod_rq[MOD_BLOCK];
+	bool _mod_fc = false;
+	bool _mod_q = false;
+	float _mod_fc_max = 0.0f;
+	float _mod_q_max = 0.0f;
+	int _mod_i = 0;
+	int _mod_n = 0;
+
+	void modulate(const float* fc_in, const float* q_in, int n)
+	{
+		ASSERT(n > 0 && n <= MOD_BLOCK);
+		_mod_i = 0;
+		_mod_n = n;
+		_mod_fc = fc_in != nullptr;
+		_mod_q = q_in != nullptr;
+		_mod_fc_max = _mod_q_max = 0.0f;
+		if (fc_in != nullptr) {
+			const __m128 k = _mm_set1_ps(-log2f(PARAMS::STEEPNESS()));
+			__m128 vmax = _mm_set1_ps(fc_in[0]);
+			int i = 0;
+			for (; i + 4 <= n; i += 4) {
+				const __m128 v = _mm_loadu_ps(fc_in + i);
+				vmax = _mm_max_ps(vmax, v);
+				_mm_storeu_ps(_mod_fc_exp + i, _mm_mul_ps(_mm_set1_ps(PARAMS::OFFSET()), fast_exp2_ps(_mm_mul_ps(v, k))));
+				_mm_storeu_ps(_mod_fc_offset + i, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(PARAMS::DISTORTION_POINT()), v), _mm_set1_ps(256.0f)), _mm_set1_ps(PARAMS::DISTORTION_RATE())));
+			}
+			float m[4];
+			_mm_storeu_ps(m, vmax);
+			_mod_fc_max = fmaxf(fmaxf(m[0], m[1]), fmaxf(m[2], m[3]));
+			for (; i < n; i++) {
+				fc = fc_in[i];
+				fc_update();
+				_mod_fc_exp[i] = fc_exp;
+				_mod_fc_offset[i] = fc_distortion_offset;
+				if (fc > _mod_fc_max) _mod_fc_max = fc;
+			}
+			fc = fc_in[n - 1];
+		}
+		if (q_in != nullptr) {
+			int i = 0;
+			for (; i + 4 <= n; i += 4) {
+				const __m128 v = _mm_loadu_ps(q_in + i);
+				_mm_storeu_ps(_mod_rq + i, _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_set1_ps(0.707f), v)));
+			}
+			for (; i < n; i++) _mod_rq[i] = 1.0f / (0.707f + q_in[i]);
+			for (i = 0; i < n; i++) {
+				if (q_in[i] > _mod_q_max) _mod_q_max = q_in[i];
+			}
+			q = q_in[n - 1];
+		}
+	}
+
+	inline void next_frame()
+	{
+		if (_mod_i >= _mod_n) return;
+		if (_mod_fc) {
+			fc_exp = _mod_fc_exp[_mod_i];
+			fc_distortion_offset = _mod_fc_offset[_mod_i];
+		}
+		if (_mod_q) rq = _mod_rq[_mod_i];
+		_mod_i++;
+	}
+
+	/*
+	the lowest sample rate the model keeps its voicing at for the current
+	fc and q. it was voiced at 16x 44.1kHz; at half that, mild settings
+	stay within about -25dB of it, but resonance changes and high fc with
+	high q goes unstable. a quarter only holds for low fc and q
+	*/
+	float min_sample_rate()
+	{
+		const float voiced = 44100.0f * 16.0f;
+		const float hi_fc = fc > _mod_fc_max ? fc : _mod_fc_max;
+		const float hi_q = q > _mod_q_max ? q : _mod_q_max;
+		if (hi_q >= 1.0f || hi_fc >= 1600.0f) return voiced;
+		if (hi_q >= 0.3f || hi_fc >= 1000.0f) return voiced * 0.5f;
+		return voiced * 0.25f;
+	}
+
+	void set_quality(int level)
+	{
+		fast_exp = level > QUALITY_HIGH;
+	}
+
 	void set_fc(float value)
 	{
 		fc = value;
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assert.h"
+
+/*
+real FFT of size n (a power of two), done as a complex FFT of size n/2 on the
+even/odd samples packed into re/im, followed by the usual split step.
+spectra are n/2+1 bins of interleaved (re, im). forward() is unscaled,
+inverse() scales by 1/m (m = n/2; the split step already halves) so that
+inverse(forward(x)) == x; inverse_unscaled() leaves that 1/m to the caller
+(e.g. folded into a filter spectrum).
+*/
+template <typename T>
+struct FFT {
+	int n;
+	int m;
+	int* bitrev;
+	T* tw;  // e^(-2 pi i k / m), k < m/2
+	T* rtw; // e^(-2 pi i k / n), k < m
+	T* work;
+
+	FFT(int size)
+	{
+		ASSERT(size >= 4 && (size & (size - 1)) == 0);
+		n = size;
+		m = size >> 1;
+
+		bitrev = (int*) malloc(sizeof(int) * m);
+		tw = (T*) malloc(sizeof(T) * m);
+		rtw = (T*) malloc(sizeof(T) * m * 2);
+		work = (T*) malloc(sizeof(T) * m * 2);
+		AN(bitrev); AN(tw); AN(rtw); AN(work);
+
+		int bits = 0;
+		while ((1 << bits) < m) bits++;
+		for (int i = 0; i < m; i++) {
+			int r = 0;
+			for (int b = 0; b < bits; b++) {
+				if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+			}
+			bitrev[i] = r;
+		}
+
+		for (int k = 0; k < (m >> 1); k++) {
+			double a = -2.0 * M_PI * (double)k / (double)m;
+			tw[k*2] = cos(a);
+			tw[k*2+1] = sin(a);
+		}
+
+		for (int k = 0; k < m; k++) {
+			double a = -2.0 * M_PI * (double)k / (double)n;
+			rtw[k*2] = cos(a);
+			rtw[k*2+1] = sin(a);
+		}
+	}
+
+	FFT(FFT<T> const&) = delete;
+	void operator=(FFT<T> const&) = delete;
+
+	~FFT()
+	{
+		free(bitrev);
+		free(tw);
+		free(rtw);
+		free(work);
+	}
+
+	// in place complex FFT of size m on interleaved data
+	void _cfft(T* z, bool inverse)
+	{
+		for (int i = 0; i < m; i++) {
+			int j = bitrev[i];
+			if (j > i) {
+				T re = z[i*2], im = z[i*2+1];
+				z[i*2] = z[j*2]; z[i*2+1] = z[j*2+1];
+				z[j*2] = re; z[j*2+1] = im;
+			}
+		}
+
+		for (int len = 2; len <= m; len <<= 1) {
+			int half = len >> 1;
+			int step = m / len;
+			for (int i = 0; i < m; i += len) {
+				for (int k = 0; k < half; k++) {
+					T wr = tw[k*step*2];
+					T wi = inverse ? -tw[k*step*2+1] : tw[k*step*2+1];
+					T* a = &z[(i+k)*2];
+					T* b = &z[(i+k+half)*2];
+					T br = b[0] * wr - b[1] * wi;
+					T bi = b[0] * wi + b[1] * wr;
+					b[0] = a[0] - br;
+					b[1] = a[1] - bi;
+					a[0] += br;
+					a[1] += bi;
+				}
+			}
+		}
+	}
+
+	// x: n reals, X: m+1 complex bins
+	void forward(const T* x, T* X)
+	{
+		memcpy(work, x, sizeof(T) * n);
+		_cfft(work, false);
+
+		const T* Z = work;
+		for (int k = 0; k <= m; k++) {
+			int k0 = (k == m) ? 0 : k;
+			int k1 = (k == 0) ? 0 : (m - k);
+			// Fe = (Z[k] + conj(Z[m-k])) / 2, Fo = (Z[k] - conj(Z[m-k])) / 2i
+			T fer = (Z[k0*2] + Z[k1*2]) * (T)0.5;
+			T fei = (Z[k0*2+1] - Z[k1*2+1]) * (T)0.5;
+			T for_ = (Z[k0*2+1] + Z[k1*2+1]) * (T)0.5;
+			T foi = -(Z[k0*2] - Z[k1*2]) * (T)0.5;
+			T wr, wi;
+			if (k == m) {
+				wr = -1; wi = 0;
+			} else {
+				wr = rtw[k*2]; wi = rtw[k*2+1];
+			}
+			X[k*2] = fer + (for_ * wr - foi * wi);
+			X[k*2+1] = fei + (for_ * wi + foi * wr);
+		}
+	}
+
+	// X: m+1 complex bins, x: n reals, scaled by m (half of n) relative to
+	// the true inverse
+	void inverse_unscaled(const T* X, T* x)
+	{
+		for (int k = 0; k < m; k++) {
+			int k1 = m - k;
+			// Fe = (X[k] + conj(X[m-k])) / 2, Fo = (X[k] - conj(X[m-k])) * conj(W^k) / 2
+			T fer = (X[k*2] + X[k1*2]) * (T)0.5;
+			T fei = (X[k*2+1] - X[k1*2+1]) * (T)0.5;
+			T dr = (X[k*2] - X[k1*2]) * (T)0.5;
+			T di = (X[k*2+1] + X[k1*2+1]) * (T)0.5;
+			T wr = rtw[k*2], wi = -rtw[k*2+1];
+			T for_ = dr * wr - di * wi;
+			T foi = dr * wi + di * wr;
+			// Z = Fe + i Fo
+			work[k*2] = fer - foi;
+			work[k*2+1] = fei + for_;
+		}
+		_cfft(work, true);
+		memcpy(x, work, sizeof(T) * n);
+	}
+
+	void inverse(const T* X, T* x)
+	{
+		inverse_unscaled(X, x);
+		const T s = (T)1 / (T)m;
+		for (int i = 0; i < n; i++) {
+			x[i] *= s;
+		}
+	}
+};
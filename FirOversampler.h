@@ -1,9 +1,62 @@
 #pragma once
 
 #include <math.h>
+#include <string.h>
 
+#include <type_traits>
+#include <utility>
+
+#include "Dsp.h"
 #include "Math.h"
+#include "Quality.h"
 #include "Tables.h"
+#include "CallbackStats.h"
+#include "assert.h"
+
+/*
+lays a compact downsampler FIR (see Tables::get_compact_downsampler_fir())
+out over the ratio * zero_crossings * 2 + 1 values of history it's applied
+to: from the center outwards in both directions, skipping every ratio-th
+position (zero crossings), with the center tap at 1
+*/
+template <typename Q>
+static void fir_oversampler_layout(const Q* fir, int ratio, int zero_crossings, Q* full)
+{
+	const int size = ratio * zero_crossings * 2 + 1;
+	const int fir_size = ratio * zero_crossings - zero_crossings;
+	for (int k = 0; k < size; k++) full[k] = 0;
+	full[ratio * zero_crossings] = 1;
+	int idx = 1;
+	int n = ratio - 1;
+	auto place = [&](int i) {
+		full[idx++] += fir[i];
+		n--;
+		if (n == 0) {
+			// skip zero crossing
+			idx++;
+			n = ratio - 1;
+		}
+	};
+	for (int i = (fir_size - 1); i >= 0; i--) place(i);
+	for (int i = 0; i < fir_size; i++) place(i);
+}
+
+/*
+at ratio 2 the FIR is half-band: the taps an even distance from the center
+are all zero crossings, so only the center and the odd taps are summed,
+inline. that's ZERO_CROSSINGS * 2 + 1 products instead of twice as many, and
+no call; the Dsp kernels lose to it at these lengths
+*/
+template <typename T, typename Q>
+static inline T fir_oversampler_halfband(const T* window, const Q* taps, int zero_crossings, int ch)
+{
+	const int mid = zero_crossings * 2;
+	T signal = T(window[mid]) * taps[mid * ch];
+	for (int k = 1; k < mid * 2; k += 2) {
+		signal += T(window[k]) * taps[k * ch];
+	}
+	return signal;
+}
 
 template <typename SAMPLER, int RATIO, int ZERO_CROSSINGS, double (*WINDOW_FN)(double)>
 struct FirOversampler : public SAMPLER {
@@ -16,22 +69,104 @@ struct FirOversampler : public SAMPLER {
 	typedef typename SAMPLER::T T;
 	typedef typename SAMPLER::Q Q;
 
-	T _fo_buffer[_FO_BUFFER_SIZE];
+	// T as interleaved floats, for the Dsp kernels
+	static constexpr int _FO_CH = sizeof(T) / sizeof(Q);
+	static constexpr bool _FO_FLAT = std::is_same<Q, float>::value && sizeof(T) == sizeof(Q) * _FO_CH && (_FO_CH == 1 || _FO_CH == 2 || _FO_CH == 4);
+
+	// the history is stored twice over, so that the last _FO_BUFFER_SIZE
+	// values are always contiguous, oldest first, at _fo_buffer_index
+	T _fo_buffer[_FO_BUFFER_SIZE * 2];
 	int _fo_buffer_index = 0;
 	Q* _fo_fir;
+	// _fo_fir laid out over that window (zero crossings and the center tap
+	// included), each tap repeated for every channel
+	Q _fo_taps[_FO_BUFFER_SIZE * _FO_CH];
+	const DspKernels* _fo_dsp;
 
 	void set_sample_rate(float sample_rate)
 	{
 		SAMPLER::set_sample_rate(sample_rate * RATIO);
 	}
 
+	// builds the tables this type and SAMPLER need; see Tables::freeze()
+	static void prewarm()
+	{
+		Tables<Q>::get_instance().get_compact_downsampler_fir(RATIO, ZERO_CROSSINGS, WINDOW_FN);
+		_fo_prewarm_sampler<SAMPLER>(0);
+	}
+
+	template <typename S>
+	static auto _fo_prewarm_sampler(int) -> decltype(S::prewarm(), void())
+	{
+		S::prewarm();
+	}
+
+	template <typename S>
+	static void _fo_prewarm_sampler(long) {}
+
 	FirOversampler()
 	{
 		_fo_fir = Tables<Q>::get_instance().get_compact_downsampler_fir(RATIO, ZERO_CROSSINGS, WINDOW_FN);
+		_fo_dsp = dsp_get_kernels();
+
+		Q full[_FO_BUFFER_SIZE];
+		fir_oversampler_layout(_fo_fir, RATIO, ZERO_CROSSINGS, full);
+		for (int k = 0; k < _FO_BUFFER_SIZE; k++) {
+			for (int c = 0; c < _FO_CH; c++) _fo_taps[k * _FO_CH + c] = full[k];
+		}
+	}
+
+	/*
+	a SAMPLER with sleeping() can stop: while it sleeps, its output is a
+	held constant, so instead of pushing RATIO copies per sample until the
+	history is flat and filtering them, the history is filled with it once
+	and the filtered value is returned as is. nothing else runs until the
+	SAMPLER wakes.
+	*/
+	bool _fo_asleep = false;
+	T _fo_sleep_value;
+
+	template <typename S>
+	auto _fo_sampler_sleeping(int) -> decltype(std::declval<S&>().sleeping(), bool())
+	{
+		return S::sleeping();
+	}
+
+	template <typename S>
+	bool _fo_sampler_sleeping(long)
+	{
+		return false;
+	}
+
+	bool sleeping()
+	{
+		return _fo_sampler_sleeping<SAMPLER>(0);
+	}
+
+	// a SAMPLER with next_frame() is told where output frames begin, for
+	// per-frame modulation (see Mod.h); asleep or not
+	template <typename S>
+	auto _fo_next_frame(int) -> decltype(std::declval<S&>().next_frame(), void())
+	{
+		S::next_frame();
 	}
 
+	template <typename S>
+	void _fo_next_frame(long) {}
+
 	inline T sample()
 	{
+		_fo_next_frame<SAMPLER>(0);
+		if (_fo_sampler_sleeping<SAMPLER>(0)) {
+			if (!_fo_asleep) {
+				const T held = SAMPLER::sample();
+				for (int k = 0; k < _FO_BUFFER_SIZE * 2; k++) _fo_buffer[k] = held;
+				_fo_sleep_value = _fo_yield();
+				_fo_asleep = true;
+			}
+			return _fo_sleep_value;
+		}
+		_fo_asleep = false;
 		for (int s = 0; s < RATIO; s++) {
 			_fo_push(SAMPLER::sample());
 		}
@@ -40,44 +175,281 @@ struct FirOversampler : public SAMPLER {
 
 	inline void _fo_push(T value)
 	{
-		_fo_buffer[_fo_buffer_index++] = value;
-		if(_fo_buffer_index >= _FO_BUFFER_SIZE) _fo_buffer_index = 0;
+		_fo_buffer[_fo_buffer_index] = _fo_buffer[_fo_buffer_index + _FO_BUFFER_SIZE] = value;
+		if(++_fo_buffer_index >= _FO_BUFFER_SIZE) _fo_buffer_index = 0;
 	}
 
-	inline void _fo_step(int i, int& idx, int& n, T& signal)
+	inline T _fo_yield()
 	{
-		if (idx >= _FO_BUFFER_SIZE) {
-			idx -= _FO_BUFFER_SIZE;
+		CBS_STAGE(CBS_STAGE_DECIMATE);
+		const T* window = _fo_buffer + _fo_buffer_index;
+		if (RATIO == 2) {
+			return fir_oversampler_halfband(window, _fo_taps, ZERO_CROSSINGS, _FO_CH);
+		} else if (_FO_FLAT) {
+			Q out[_FO_CH];
+			dsp_macc(_fo_dsp, (float*)out, (const float*)window, (const float*)_fo_taps, _FO_BUFFER_SIZE * _FO_CH, _FO_CH);
+			T signal;
+			memcpy(&signal, out, sizeof(T));
+			return signal;
+		} else {
+			T signal = window[_FO_BUFFER_MID];
+			for (int k = 0; k < _FO_BUFFER_SIZE; k++) {
+				if (k != _FO_BUFFER_MID && _fo_taps[k * _FO_CH] != 0) signal += T(window[k]) * _fo_taps[k * _FO_CH];
+			}
+			return signal;
 		}
-		signal += _fo_buffer[idx] * _fo_fir[i];
-		idx++;
-		n--;
-		if (n == 0) {
-			// skip zero crossing
-			idx++;
-			n = RATIO - 1;
+	}
+};
+
+template <typename SAMPLER, int RATIO, int ZERO_CROSSINGS>
+using KaiserBesselFirOversampler = FirOversampler<SAMPLER, RATIO, ZERO_CROSSINGS, kaiser_bessel>;
+
+/*
+FirOversampler with a ratio that can change at runtime, per voice: any power
+of two from MIN_RATIO to MAX_RATIO, each with its own FIR from Tables. the
+SAMPLER is re-rated with set_sample_rate() on every change, so it has to
+keep its sound across rate changes (Skaar does).
+
+every ratio's window spans the same stretch of time (ZERO_CROSSINGS output
+samples either side of the center), so on a change the history is resampled
+into the new window (every n-th value going down, linear interpolation going
+up) and filtering carries on without a gap; the interpolation error only
+lasts until the window has been refilled, ZERO_CROSSINGS * 2 output samples.
+
+with auto_ratio, a SAMPLER with wanted_ratio(output_rate, max_ratio) picks
+the ratio, asked before every output sample: ratios go up right away (a
+filter may need it to stay stable) and down only once less has been wanted
+for DOWN_DELAY samples in a row, so a voice sitting on a boundary doesn't
+toggle. without wanted_ratio(), each quality level below QUALITY_HIGH
+halves the ratio (see Quality.h); with it, set_quality() is passed on and
+the SAMPLER decides.
+
+the FIRs pass DC at a gain of their ratio; all of them are scaled to
+MAX_RATIO's, so levels match a FirOversampler at MAX_RATIO.
+*/
+template <typename SAMPLER, int MAX_RATIO, int ZERO_CROSSINGS, double (*WINDOW_FN)(double), int MIN_RATIO = 2>
+struct DynFirOversampler : public SAMPLER {
+	static constexpr int DOWN_DELAY = 1024;
+
+	static constexpr int _dfo_log2(int x) { return x <= 1 ? 0 : 1 + _dfo_log2(x >> 1); }
+
+	static constexpr int _DFO_MAX_SIZE = MAX_RATIO * ZERO_CROSSINGS * 2 + 1;
+	static constexpr int _DFO_LEVELS = _dfo_log2(MAX_RATIO / MIN_RATIO) + 1;
+
+	static_assert(MIN_RATIO >= 2 && (MIN_RATIO & (MIN_RATIO - 1)) == 0, "MIN_RATIO must be a power of two, at least 2");
+	static_assert(MAX_RATIO == (MIN_RATIO << (_DFO_LEVELS - 1)), "MAX_RATIO must be MIN_RATIO times a power of two");
+
+	typedef typename SAMPLER::T T;
+	typedef typename SAMPLER::Q Q;
+
+	static constexpr int _DFO_CH = sizeof(T) / sizeof(Q);
+	static constexpr bool _DFO_FLAT = std::is_same<Q, float>::value && sizeof(T) == sizeof(Q) * _DFO_CH && (_DFO_CH == 1 || _DFO_CH == 2 || _DFO_CH == 4);
+
+	// doubled history like FirOversampler's, _dfo_size values at a time
+	T _dfo_buffer[_DFO_MAX_SIZE * 2];
+	int _dfo_buffer_index = 0;
+	int _dfo_ratio = MAX_RATIO;
+	int _dfo_size = _DFO_MAX_SIZE;
+	const Q* _dfo_taps;
+	Q _dfo_taps_by_level[_DFO_LEVELS][_DFO_MAX_SIZE * _DFO_CH];
+	const DspKernels* _dfo_dsp;
+	float _dfo_sample_rate = 0.0f;
+
+	bool auto_ratio = true;
+	int _dfo_quality = QUALITY_HIGH;
+	int _dfo_down_count = 0;
+
+	bool _dfo_asleep = false;
+	T _dfo_sleep_value;
+
+	static void prewarm()
+	{
+		for (int r = MIN_RATIO; r <= MAX_RATIO; r <<= 1) {
+			Tables<Q>::get_instance().get_compact_downsampler_fir(r, ZERO_CROSSINGS, WINDOW_FN);
 		}
+		_dfo_prewarm_sampler<SAMPLER>(0);
 	}
 
-	inline T _fo_yield()
+	template <typename S>
+	static auto _dfo_prewarm_sampler(int) -> decltype(S::prewarm(), void())
+	{
+		S::prewarm();
+	}
+
+	template <typename S>
+	static void _dfo_prewarm_sampler(long) {}
+
+	DynFirOversampler()
+	{
+		memset(_dfo_buffer, 0, sizeof(_dfo_buffer));
+		_dfo_dsp = dsp_get_kernels();
+		for (int l = 0; l < _DFO_LEVELS; l++) {
+			const int r = MIN_RATIO << l;
+			Q full[_DFO_MAX_SIZE];
+			fir_oversampler_layout(Tables<Q>::get_instance().get_compact_downsampler_fir(r, ZERO_CROSSINGS, WINDOW_FN), r, ZERO_CROSSINGS, full);
+			const Q gain = (Q)(MAX_RATIO / r);
+			for (int k = 0; k < r * ZERO_CROSSINGS * 2 + 1; k++) {
+				for (int c = 0; c < _DFO_CH; c++) _dfo_taps_by_level[l][k * _DFO_CH + c] = full[k] * gain;
+			}
+		}
+		_dfo_taps = _dfo_taps_by_level[_DFO_LEVELS - 1];
+	}
+
+	void set_sample_rate(float sample_rate)
+	{
+		_dfo_sample_rate = sample_rate;
+		SAMPLER::set_sample_rate(sample_rate * _dfo_ratio);
+	}
+
+	int get_ratio()
+	{
+		return _dfo_ratio;
+	}
+
+	void set_ratio(int ratio)
+	{
+		ASSERT(ratio >= MIN_RATIO && ratio <= MAX_RATIO && (ratio & (ratio - 1)) == 0);
+		if (ratio == _dfo_ratio) return;
+
+		T old[_DFO_MAX_SIZE];
+		memcpy(old, _dfo_buffer + _dfo_buffer_index, sizeof(T) * _dfo_size);
+		const int old_ratio = _dfo_ratio;
+		_dfo_ratio = ratio;
+		_dfo_size = ratio * ZERO_CROSSINGS * 2 + 1;
+		_dfo_taps = _dfo_taps_by_level[_dfo_log2(ratio / MIN_RATIO)];
+		for (int k = 0; k < _dfo_size; k++) {
+			// the same point in time in the old window
+			const int i = k * old_ratio / ratio;
+			const int rem = k * old_ratio % ratio;
+			T v = old[i];
+			if (rem != 0) {
+				const Q f = (Q)rem / (Q)ratio;
+				v = old[i] * (Q)(1 - f);
+				v += old[i + 1] * f;
+			}
+			_dfo_buffer[k] = _dfo_buffer[k + _dfo_size] = v;
+		}
+		_dfo_buffer_index = 0;
+
+		SAMPLER::set_sample_rate(_dfo_sample_rate * ratio);
+	}
+
+	void set_quality(int level)
+	{
+		_dfo_quality = level;
+		_dfo_set_quality_sampler<SAMPLER>(level, 0);
+	}
+
+	template <typename S>
+	auto _dfo_set_quality_sampler(int level, int) -> decltype(std::declval<S&>().set_quality(0), void())
+	{
+		S::set_quality(level);
+	}
+
+	template <typename S>
+	void _dfo_set_quality_sampler(int, long) {}
+
+	template <typename S>
+	auto _dfo_wanted_ratio(int) -> decltype(std::declval<S&>().wanted_ratio(0.0f, 0), int())
+	{
+		return S::wanted_ratio(_dfo_sample_rate, MAX_RATIO);
+	}
+
+	template <typename S>
+	int _dfo_wanted_ratio(long)
+	{
+		return MAX_RATIO >> _dfo_quality;
+	}
+
+	void _dfo_update_ratio()
 	{
-		int idx = _fo_buffer_index + _FO_BUFFER_MID;
-		if (idx >= _FO_BUFFER_SIZE) {
-			idx -= _FO_BUFFER_SIZE;
+		int ratio = _dfo_wanted_ratio<SAMPLER>(0);
+		if (ratio < MIN_RATIO) ratio = MIN_RATIO;
+		if (ratio > MAX_RATIO) ratio = MAX_RATIO;
+		if (ratio >= _dfo_ratio) {
+			_dfo_down_count = 0;
+			set_ratio(ratio);
+		} else if (++_dfo_down_count >= DOWN_DELAY) {
+			_dfo_down_count = 0;
+			set_ratio(ratio);
 		}
-		T signal = _fo_buffer[idx];
-		idx = _fo_buffer_index + 1;
-		int n = RATIO - 1;
-		for (int i = (_FO_FIR_SIZE - 1); i >= 0; i--) {
-			_fo_step(i, idx, n, signal);
+	}
+
+	template <typename S>
+	auto _dfo_sampler_sleeping(int) -> decltype(std::declval<S&>().sleeping(), bool())
+	{
+		return S::sleeping();
+	}
+
+	template <typename S>
+	bool _dfo_sampler_sleeping(long)
+	{
+		return false;
+	}
+
+	bool sleeping()
+	{
+		return _dfo_sampler_sleeping<SAMPLER>(0);
+	}
+
+	template <typename S>
+	auto _dfo_next_frame(int) -> decltype(std::declval<S&>().next_frame(), void())
+	{
+		S::next_frame();
+	}
+
+	template <typename S>
+	void _dfo_next_frame(long) {}
+
+	// see FirOversampler::sample()
+	inline T sample()
+	{
+		_dfo_next_frame<SAMPLER>(0);
+		if (_dfo_sampler_sleeping<SAMPLER>(0)) {
+			if (!_dfo_asleep) {
+				const T held = SAMPLER::sample();
+				for (int k = 0; k < _dfo_size * 2; k++) _dfo_buffer[k] = held;
+				_dfo_sleep_value = _dfo_yield();
+				_dfo_asleep = true;
+			}
+			return _dfo_sleep_value;
 		}
-		for (int i = 0; i < _FO_FIR_SIZE; i++) {
-			_fo_step(i, idx, n, signal);
+		_dfo_asleep = false;
+		if (auto_ratio) _dfo_update_ratio();
+		for (int s = 0; s < _dfo_ratio; s++) {
+			_dfo_push(SAMPLER::sample());
 		}
+		return _dfo_yield();
+	}
 
-		return signal;
+	inline void _dfo_push(T value)
+	{
+		_dfo_buffer[_dfo_buffer_index] = _dfo_buffer[_dfo_buffer_index + _dfo_size] = value;
+		if(++_dfo_buffer_index >= _dfo_size) _dfo_buffer_index = 0;
+	}
+
+	inline T _dfo_yield()
+	{
+		CBS_STAGE(CBS_STAGE_DECIMATE);
+		const T* window = _dfo_buffer + _dfo_buffer_index;
+		if (_dfo_ratio == 2) {
+			return fir_oversampler_halfband(window, _dfo_taps, ZERO_CROSSINGS, _DFO_CH);
+		} else if (_DFO_FLAT) {
+			Q out[_DFO_CH];
+			dsp_macc(_dfo_dsp, (float*)out, (const float*)window, (const float*)_dfo_taps, _dfo_size * _DFO_CH, _DFO_CH);
+			T signal;
+			memcpy(&signal, out, sizeof(T));
+			return signal;
+		} else {
+			const int mid = _dfo_ratio * ZERO_CROSSINGS;
+			T signal = T(window[mid]) * _dfo_taps[mid * _DFO_CH];
+			for (int k = 0; k < _dfo_size; k++) {
+				if (k != mid && _dfo_taps[k * _DFO_CH] != 0) signal += T(window[k]) * _dfo_taps[k * _DFO_CH];
+			}
+			return signal;
+		}
 	}
 };
 
-template <typename SAMPLER, int RATIO, int ZERO_CROSSINGS>
-using KaiserBesselFirOversampler = FirOversampler<SAMPLER, RATIO, ZERO_CROSSINGS, kaiser_bessel>;
+template <typename SAMPLER, int MAX_RATIO, int ZERO_CROSSINGS, int MIN_RATIO = 2>
+using KaiserBesselDynFirOversampler = DynFirOversampler<SAMPLER, MAX_RATIO, ZERO_CROSSINGS, kaiser_bessel, MIN_RATIO>;
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Bus.h"
+#include "Smpl.h"
+#include "Tables.h"
+#include "Trace.h"
+#include "assert.h"
+
+/*
+granular synthesis over a Smpl. every grain reads the sample through the same
+polyphase sinc tables as PolyphaseSmplr, at its own position and pitch,
+shaped by a window from Tables and panned (constant power on stereo buses).
+
+grains are kept structure-of-arrays in a fixed pool of MAX_GRAINS; spawn()
+drops the grain when the pool is full rather than allocating. a grain is
+spawned at an absolute time on the same clock as the PQ (render() advances
+it), so a single event can schedule a whole burst of grains, each starting on
+its exact frame. render() walks the pool grain by grain over the block, which
+keeps a grain's taps, window and gains in registers and leaves a fixed-width,
+contiguous tap loop for the compiler to vectorize.
+*/
+template <typename BUS, int MAX_GRAINS = 2048, typename STORE = BUS, int SINC_PHASES_EXP = 12>
+struct Granular {
+	static constexpr int FRAC_EXP = 20;
+	static constexpr int SINC_WIDTH_EXP = 3;
+	static constexpr int SINC_WIDTH = 1 << SINC_WIDTH_EXP;
+	static constexpr int SINC_PHASES = 1 << SINC_PHASES_EXP;
+	static constexpr int SINC_MASK = SINC_PHASES - 1;
+	static constexpr int OFFSET = -(SINC_WIDTH >> 1) + 1;
+	static constexpr int WINDOW_SIZE_EXP = 10;
+	static constexpr int WINDOW_PHASE_EXP = 32 - WINDOW_SIZE_EXP;
+
+	typedef BUS T;
+	typedef typename BUS::T Q;
+
+	Smpl<STORE>* smpl = nullptr;
+	float sample_rate;
+	int64_t t = 0;
+
+	Q* _gr_kaiser_sinc;
+	Q* _gr_down2x;
+	Q* _gr_down1_333x;
+	Q* _gr_windows[Tables<Q>::GRAIN_WINDOW_COUNT];
+
+	// the pool
+	int n = 0;
+	int64_t pos_fx[MAX_GRAINS];
+	int32_t inc_fx[MAX_GRAINS];
+	uint32_t win_phase[MAX_GRAINS];
+	uint32_t win_inc[MAX_GRAINS];
+	int64_t start[MAX_GRAINS];
+	int32_t remaining[MAX_GRAINS];
+	Q* sinc[MAX_GRAINS];
+	Q* window[MAX_GRAINS];
+	Q gain[BUS::CH][MAX_GRAINS];
+
+	static void _gr_lookup(Q** kaiser_sinc, Q** down2x, Q** down1_333x, Q** windows)
+	{
+		Tables<Q>& tables = Tables<Q>::get_instance();
+		Q* k[Tables<Q>::RESAMPLING_SINC_COUNT];
+		tables.get_resampling_sincs(SINC_WIDTH_EXP, SINC_PHASES_EXP, k);
+		*kaiser_sinc = k[Tables<Q>::RESAMPLING_SINC_UNITY];
+		*down2x = k[Tables<Q>::RESAMPLING_SINC_DOWN2X];
+		*down1_333x = k[Tables<Q>::RESAMPLING_SINC_DOWN1_333X];
+		for (int i = 0; i < Tables<Q>::GRAIN_WINDOW_COUNT; i++) {
+			windows[i] = tables.get_grain_window(i, WINDOW_SIZE_EXP);
+		}
+	}
+
+	// builds the tables this type needs; see Tables::freeze()
+	static void prewarm()
+	{
+		Q* t[3 + Tables<Q>::GRAIN_WINDOW_COUNT];
+		_gr_lookup(&t[0], &t[1], &t[2], &t[3]);
+	}
+
+	Granular()
+	{
+		_gr_lookup(&_gr_kaiser_sinc, &_gr_down2x, &_gr_down1_333x, _gr_windows);
+	}
+
+	void set_sample_rate(float value)
+	{
+		sample_rate = value;
+	}
+
+	Q* _gr_get_sinc_table(int32_t inc)
+	{
+		int d = abs(inc >> (FRAC_EXP - 4));
+		if (d > 0x18) {
+			return _gr_down2x;
+		} else if(d > 0x12) {
+			return _gr_down1_333x;
+		} else {
+			return _gr_kaiser_sinc;
+		}
+	}
+
+	/*
+	spawns a grain at time at (>= the current time), reading from frame pos
+	(a double, so that fractions survive far into long samples) at hz
+	(relative to the sample's base, like Smplr::set_hz()) for duration
+	seconds. pan goes from -1 (left) to 1 (right). returns false if the pool
+	is full.
+	*/
+	bool spawn(int64_t at, double pos, float hz, float duration, int window_kind, Q g, float pan = 0.0f)
+	{
+		ASSERT(smpl != nullptr);
+		ASSERT(window_kind >= 0 && window_kind < Tables<Q>::GRAIN_WINDOW_COUNT);
+		if (n == MAX_GRAINS) return false;
+
+		int32_t frames = duration * sample_rate;
+		if (frames <= 0) return true;
+		// win_inc is a whole turn over frames, which must fit in 32 bits
+		if (frames < 2) frames = 2;
+
+		int i = n++;
+		float inc = hz / smpl->base * smpl->sample_rate / sample_rate;
+		pos_fx[i] = (int64_t)(pos * (double)(1 << FRAC_EXP));
+		inc_fx[i] = inc * (1 << FRAC_EXP);
+		win_phase[i] = 0;
+		win_inc[i] = (uint32_t)(4294967296.0 / (double)frames);
+		start[i] = at < t ? t : at;
+		remaining[i] = frames;
+		sinc[i] = _gr_get_sinc_table(inc_fx[i]);
+		window[i] = _gr_windows[window_kind];
+
+		if (BUS::CH == 2) {
+			float a = (clampf(pan, -1.0f, 1.0f) + 1.0f) * (float)(M_PI / 4.0);
+			gain[0][i] = g * cosf(a);
+			gain[1][i] = g * sinf(a);
+		} else {
+			for (int ch = 0; ch < BUS::CH; ch++) {
+				gain[ch][i] = g;
+			}
+		}
+
+		return true;
+	}
+
+	void _gr_remove(int i)
+	{
+		int j = --n;
+		pos_fx[i] = pos_fx[j];
+		inc_fx[i] = inc_fx[j];
+		win_phase[i] = win_phase[j];
+		win_inc[i] = win_inc[j];
+		start[i] = start[j];
+		remaining[i] = remaining[j];
+		sinc[i] = sinc[j];
+		window[i] = window[j];
+		for (int ch = 0; ch < BUS::CH; ch++) {
+			gain[ch][i] = gain[ch][j];
+		}
+	}
+
+	inline BUS _gr_tap(const STORE* src, const Q* lut)
+	{
+		BUS value = BUS();
+		for (int k = 0; k < SINC_WIDTH; k++) {
+			value.accumulate(smpl_widen_unscaled<BUS>(src[k]).scale(lut[k]));
+		}
+		return value;
+	}
+
+	void _gr_render_grain(int i, BUS* out, int m)
+	{
+		int64_t p_fx = pos_fx[i];
+		const int32_t inc = inc_fx[i];
+		uint32_t wp = win_phase[i];
+		const uint32_t wi = win_inc[i];
+		const Q* tbl = sinc[i];
+		const Q* win = window[i];
+		const int64_t frames = smpl->frames;
+
+		Q g[BUS::CH];
+		for (int ch = 0; ch < BUS::CH; ch++) {
+			g[ch] = gain[ch][i] * SmplFmt<typename STORE::T>::SCALE;
+		}
+
+		for (int k = 0; k < m; k++) {
+			const int64_t first = (p_fx >> FRAC_EXP) + OFFSET;
+			const Q* lut = tbl + ((p_fx >> (FRAC_EXP - SINC_PHASES_EXP)) & SINC_MASK) * SINC_WIDTH;
+
+			BUS value;
+			if (first >= 0 && (first + SINC_WIDTH) <= frames) {
+				value = _gr_tap(&smpl->data[first], lut);
+			} else {
+				STORE edge[SINC_WIDTH];
+				for (int j = 0; j < SINC_WIDTH; j++) {
+					edge[j] = (*smpl)[first + j];
+				}
+				value = _gr_tap(edge, lut);
+			}
+
+			// window, linearly interpolated
+			const uint32_t wx = wp >> WINDOW_PHASE_EXP;
+			const Q wf = (Q)(wp & ((1u << WINDOW_PHASE_EXP) - 1)) * (Q)(1.0 / (double)(1u << WINDOW_PHASE_EXP));
+			const Q w = win[wx] + (win[wx + 1] - win[wx]) * wf;
+
+			for (int ch = 0; ch < BUS::CH; ch++) {
+				out[k].value[ch] += value.value[ch] * (w * g[ch]);
+			}
+
+			p_fx += inc;
+			wp += wi;
+		}
+
+		pos_fx[i] = p_fx;
+		win_phase[i] = wp;
+	}
+
+	// renders n frames into out and advances the clock by n
+	void render(BUS* out, int n_frames)
+	{
+		TRACE_SCOPE("grains");
+		memset(out, 0, sizeof(BUS) * n_frames);
+		const int64_t t1 = t + n_frames;
+		for (int i = 0; i < n; ) {
+			if (start[i] >= t1) {
+				i++;
+				continue;
+			}
+			int offset = start[i] > t ? (int)(start[i] - t) : 0;
+			int m = n_frames - offset;
+			if (m > remaining[i]) m = remaining[i];
+			_gr_render_grain(i, out + offset, m);
+			remaining[i] -= m;
+			if (remaining[i] == 0) {
+				_gr_remove(i);
+			} else {
+				i++;
+			}
+		}
+		t = t1;
+	}
+};
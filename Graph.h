@@ -0,0 +1,400 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "Bus.h"
+#include "BusBuffer.h"
+#include "RenderPool.h"
+#include "Trace.h"
+#include "assert.h"
+
+/*
+audio processing graph. nodes wrap existing components (anything with a
+sample(), a render() or, for effects, a process()) and produce one BUS
+buffer per block; connections feed a node's output into an input port of
+another, with a gain. several connections into the same port are summed,
+which is all a send or a submix is.
+
+compile() turns the graph into a flat execution plan once: it keeps only the
+nodes the output depends on, sorts them topologically (Kahn) into levels of
+nodes whose inputs are all computed by earlier levels, and assigns every
+output and every summed port a buffer from a preallocated pool, reusing
+buffers whose lifetimes (in levels) don't overlap. a port with a single
+unity-gain connection reads its source's buffer directly. process() then
+just walks the plan; nodes in the same level are independent and, given a
+RenderPool, run in parallel.
+
+nothing is allocated in process(). blocks longer than MAX_BLOCK are split.
+*/
+
+template <typename BUS>
+struct GraphNode {
+	int n_inputs;
+
+	GraphNode(int n_inputs) : n_inputs(n_inputs) {}
+	virtual ~GraphNode() {}
+	virtual void set_sample_rate(float sample_rate) {}
+
+	// inputs: one buffer per input port; out must be fully written
+	virtual void process(BUS** inputs, BUS* out, int n) = 0;
+};
+
+// mono sources on wider buses are copied to every channel
+template <typename BUS>
+static inline void graph_assign(BUS& dst, typename BUS::T v)
+{
+	for (int ch = 0; ch < BUS::CH; ch++) dst.value[ch] = v;
+}
+
+template <typename BUS>
+static inline void graph_assign(BUS& dst, BUS v)
+{
+	dst = v;
+}
+
+template <typename BUS, typename SAMPLER>
+struct GraphSampler : public GraphNode<BUS> {
+	SAMPLER sampler;
+
+	GraphSampler() : GraphNode<BUS>(0) {}
+
+	void set_sample_rate(float sample_rate)
+	{
+		sampler.set_sample_rate(sample_rate);
+	}
+
+	void process(BUS**, BUS* out, int n)
+	{
+		for (int i = 0; i < n; i++) {
+			graph_assign<BUS>(out[i], sampler.sample());
+		}
+	}
+};
+
+template <typename BUS, typename RENDERER>
+struct GraphRenderer : public GraphNode<BUS> {
+	RENDERER renderer;
+
+	GraphRenderer() : GraphNode<BUS>(0) {}
+
+	void set_sample_rate(float sample_rate)
+	{
+		renderer.set_sample_rate(sample_rate);
+	}
+
+	void process(BUS**, BUS* out, int n)
+	{
+		renderer.render(out, n);
+	}
+};
+
+// for effects with process(const BUS* in, BUS* out, int n), e.g. Convolver
+template <typename BUS, typename EFFECT>
+struct GraphEffect : public GraphNode<BUS> {
+	EFFECT effect;
+
+	GraphEffect() : GraphNode<BUS>(1) {}
+
+	void process(BUS** inputs, BUS* out, int n)
+	{
+		effect.process(inputs[0], out, n);
+	}
+};
+
+// a submix: the sum of its input connections, times gain
+template <typename BUS>
+struct GraphMix : public GraphNode<BUS> {
+	typename BUS::T gain;
+
+	GraphMix(typename BUS::T gain = 1) : GraphNode<BUS>(1), gain(gain) {}
+
+	void process(BUS** inputs, BUS* out, int n)
+	{
+		bus_gain(out, inputs[0], gain, n);
+	}
+};
+
+template <typename BUS, int MAX_BLOCK = 256>
+struct Graph {
+	static constexpr int MAX_PORTS = 8;
+
+	typedef typename BUS::T Q;
+
+	struct Connection {
+		int src;
+		int dst;
+		int port;
+		Q gain;
+	};
+
+	struct Term {
+		int buffer;
+		Q gain;
+	};
+
+	struct Step {
+		GraphNode<BUS>* node;
+		int out;                    // buffer index
+		int port_buffer[MAX_PORTS]; // buffer read by each port
+		int term_begin[MAX_PORTS];  // terms to sum into port_buffer, if any
+		int term_end[MAX_PORTS];
+	};
+
+	std::vector<GraphNode<BUS>*> nodes;
+	std::vector<Connection> connections;
+	int output = -1;
+
+	// the plan
+	std::vector<Step> steps;
+	std::vector<int> level_begin; // steps of level l: [level_begin[l], level_begin[l+1])
+	std::vector<Term> terms;
+	int n_buffers = 0;
+	BUS* buffers = nullptr;
+	BUS* zero = nullptr;
+	int output_buffer = -1;
+	bool compiled = false;
+
+	RenderPool* pool = nullptr;
+	int _n; // block length for _run_step() tasks
+	int _level;
+
+	Graph() {}
+	Graph(Graph const&) = delete;
+	void operator=(Graph const&) = delete;
+
+	~Graph()
+	{
+		for (auto* node : nodes) delete node;
+		free(buffers);
+	}
+
+	// takes ownership of node; returns its id
+	int add(GraphNode<BUS>* node)
+	{
+		ASSERT(!compiled);
+		ASSERT(node->n_inputs <= MAX_PORTS);
+		nodes.push_back(node);
+		return nodes.size() - 1;
+	}
+
+	template <typename NODE>
+	NODE& get(int id)
+	{
+		return *(NODE*) nodes[id];
+	}
+
+	void connect(int src, int dst, int port = 0, Q gain = 1)
+	{
+		ASSERT(!compiled);
+		ASSERT(src >= 0 && src < (int)nodes.size());
+		ASSERT(dst >= 0 && dst < (int)nodes.size());
+		ASSERT(port >= 0 && port < nodes[dst]->n_inputs);
+		Connection c;
+		c.src = src;
+		c.dst = dst;
+		c.port = port;
+		c.gain = gain;
+		connections.push_back(c);
+	}
+
+	void set_output(int id)
+	{
+		output = id;
+	}
+
+	void set_sample_rate(float sample_rate)
+	{
+		for (auto* node : nodes) node->set_sample_rate(sample_rate);
+	}
+
+	// buffer pool; a buffer is free again after the last level reading it
+	int _alloc(std::vector<int>& free_list)
+	{
+		if (!free_list.empty()) {
+			int b = free_list.back();
+			free_list.pop_back();
+			return b;
+		}
+		return n_buffers++;
+	}
+
+	void compile()
+	{
+		ASSERT(!compiled);
+		ASSERT(output >= 0);
+		const int N = nodes.size();
+
+		// nodes the output depends on
+		std::vector<bool> live(N, false);
+		std::vector<int> stack(1, output);
+		live[output] = true;
+		while (!stack.empty()) {
+			int id = stack.back();
+			stack.pop_back();
+			for (auto& c : connections) {
+				if (c.dst == id && !live[c.src]) {
+					live[c.src] = true;
+					stack.push_back(c.src);
+				}
+			}
+		}
+
+		// Kahn's algorithm, a level at a time
+		std::vector<int> in_degree(N, 0);
+		for (auto& c : connections) {
+			if (live[c.dst]) in_degree[c.dst]++;
+		}
+		std::vector<int> level_of(N, -1);
+		std::vector<int> order;
+		std::vector<int> current;
+		for (int i = 0; i < N; i++) {
+			if (live[i] && in_degree[i] == 0) current.push_back(i);
+		}
+		int n_levels = 0;
+		while (!current.empty()) {
+			std::vector<int> next;
+			for (int id : current) {
+				level_of[id] = n_levels;
+				order.push_back(id);
+				for (auto& c : connections) {
+					if (c.src == id && live[c.dst] && --in_degree[c.dst] == 0) {
+						next.push_back(c.dst);
+					}
+				}
+			}
+			level_begin.push_back(order.size() - current.size());
+			n_levels++;
+			current.swap(next);
+		}
+		level_begin.push_back(order.size());
+		for (int i = 0; i < N; i++) {
+			if (live[i] && level_of[i] < 0) arghf("graph has a cycle");
+		}
+
+		// last level reading each node's output (the output node's buffer
+		// outlives the plan)
+		std::vector<int> last_use(N, -1);
+		for (auto& c : connections) {
+			if (live[c.dst] && level_of[c.dst] > last_use[c.src]) last_use[c.src] = level_of[c.dst];
+		}
+		last_use[output] = n_levels;
+
+		std::vector<int> buffer_of(N, -1);
+		std::vector<int> free_list;
+		std::vector<int> temps;
+		steps.resize(order.size());
+		for (int l = 0; l < n_levels; l++) {
+			temps.clear();
+			for (int k = level_begin[l]; k < level_begin[l + 1]; k++) {
+				int id = order[k];
+				Step& st = steps[k];
+				st.node = nodes[id];
+				st.out = buffer_of[id] = _alloc(free_list);
+				for (int p = 0; p < st.node->n_inputs; p++) {
+					int n_conn = 0;
+					Connection* single = nullptr;
+					for (auto& c : connections) {
+						if (c.dst == id && c.port == p) {
+							n_conn++;
+							single = &c;
+						}
+					}
+					st.term_begin[p] = st.term_end[p] = terms.size();
+					if (n_conn == 0) {
+						st.port_buffer[p] = -1; // silence
+					} else if (n_conn == 1 && single->gain == (Q)1) {
+						st.port_buffer[p] = buffer_of[single->src];
+					} else {
+						st.port_buffer[p] = _alloc(free_list);
+						temps.push_back(st.port_buffer[p]);
+						for (auto& c : connections) {
+							if (c.dst == id && c.port == p) {
+								Term t;
+								t.buffer = buffer_of[c.src];
+								t.gain = c.gain;
+								terms.push_back(t);
+							}
+						}
+						st.term_end[p] = terms.size();
+					}
+				}
+			}
+			// all of this level's buffers are allocated before any is
+			// released, so nodes of a level never share one
+			for (int b : temps) free_list.push_back(b);
+			for (int k = 0; k < level_begin[l + 1]; k++) {
+				int id = order[k];
+				if (last_use[id] == l) free_list.push_back(buffer_of[id]);
+			}
+		}
+		output_buffer = buffer_of[output];
+
+		buffers = (BUS*) aligned_alloc(64, sizeof(BUS) * MAX_BLOCK * (n_buffers + 1));
+		AN(buffers);
+		memset(buffers, 0, sizeof(BUS) * MAX_BLOCK * (n_buffers + 1));
+		zero = buffers + (size_t)n_buffers * MAX_BLOCK;
+		compiled = true;
+	}
+
+	inline BUS* _buffer(int b)
+	{
+		return b < 0 ? zero : buffers + (size_t)b * MAX_BLOCK;
+	}
+
+	void _run_step(Step& st, int n)
+	{
+		BUS* inputs[MAX_PORTS];
+		for (int p = 0; p < st.node->n_inputs; p++) {
+			BUS* in = _buffer(st.port_buffer[p]);
+			if (st.term_begin[p] != st.term_end[p]) {
+				bus_zero(in, n);
+				for (int t = st.term_begin[p]; t < st.term_end[p]; t++) {
+					bus_mix(in, _buffer(terms[t].buffer), terms[t].gain, n);
+				}
+			}
+			inputs[p] = in;
+		}
+		st.node->process(inputs, _buffer(st.out), n);
+	}
+
+	static void _task(void* ctx, int task)
+	{
+		Graph* self = (Graph*) ctx;
+		self->_run_step(self->steps[self->level_begin[self->_level] + task], self->_n);
+	}
+
+	void _process_block(BUS* out, int n)
+	{
+		const int n_levels = level_begin.size() - 1;
+		for (int l = 0; l < n_levels; l++) {
+			int begin = level_begin[l];
+			int width = level_begin[l + 1] - begin;
+			if (pool != nullptr && width > 1) {
+				_n = n;
+				_level = l;
+				pool->run(width, _task, this);
+			} else {
+				for (int k = begin; k < begin + width; k++) {
+					_run_step(steps[k], n);
+				}
+			}
+		}
+		memcpy(out, _buffer(output_buffer), sizeof(BUS) * n);
+	}
+
+	void process(BUS* out, int n)
+	{
+		ASSERT(compiled);
+		TRACE_SCOPE("graph");
+		while (n > 0) {
+			int m = n < MAX_BLOCK ? n : MAX_BLOCK;
+			_process_block(out, m);
+			out += m;
+			n -= m;
+		}
+	}
+};
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include <emmintrin.h>
 
 static inline double bessel_I0(double x)
 {
@@ -16,7 +18,7 @@ static inline double bessel_I0(double x)
 	return s;
 }
 
-static inline double kaiser_bessel(double x)
+static inline double _kaiser_bessel_alpha()
 {
 	double alpha = 0.0;
 	double att = 40.;
@@ -25,9 +27,132 @@ static inline double kaiser_bessel(double x)
 	} else if (att > 20.0f) {
 		alpha = 0.5842f * pow(att - 21.0f, 0.4f) + 0.07886f * (att - 21.0f);
 	}
-	return bessel_I0(alpha * sqrt(1.0f - x*x)) / bessel_I0(alpha);
+	return alpha;
+}
+
+// alpha and its I0 are the same for every x
+static inline double kaiser_bessel(double x)
+{
+	static const double alpha = _kaiser_bessel_alpha();
+	static const double i0_alpha = bessel_I0(alpha);
+	return bessel_I0(alpha * sqrt(1.0f - x*x)) / i0_alpha;
+}
+
+/*
+fast exp2, log2 and sin, four at a time in SSE registers (fast_*_ps), or one
+at a time (fast_*f: the same code on one lane, so a value computed per
+sample and the same value computed for a block agree bit for bit). largest
+errors, measured against double precision libm:
+
+  fast_exp2f(x)       1.1e-7 relative (1 ulp); 0 below -127, inf above 128
+  fast_log2f(x)       8e-8 absolute where |log2(x)| < 1, relative above; x
+                      must be a normal float > 0 (no denormals, inf or NaN)
+  fast_semitonesf(x)  2^(x/12): 3.2e-7 relative (0.0005 cents) for |x| < 60
+  fast_sinf(x)        6.3e-7 absolute for |x| <= 2pi. the range reduction is
+                      in float, so it grows with |x|: 9e-5 at |x| = 1000
+
+exp2 and log2 use Cephes' polynomials (exp2f on [-1/2, 1/2], logf on
+[sqrt(1/2), sqrt(2)]) after splitting off the exponent; sin is reduced to
+[0, pi/2] and a degree 9 minimax polynomial.
+
+the gain is in doing four at a time: 3-5x less per value than libm. one at a
+time they're about as fast as glibc's own exp2f and sinf, faster than powf
+and slower than log2f (see bench), so what stays setup-only (slope_coef())
+stays on libm; what modulation drives per sample (pitch, F6581's fc) uses
+these, so a parameter set once and the same parameter modulated agree.
+*/
+static inline __m128 _fast_madd_ps(__m128 a, __m128 b, __m128 c)
+{
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+}
+
+static inline __m128 fast_exp2_ps(__m128 x)
+{
+	x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-127.0f)), _mm_set1_ps(128.0f));
+	const __m128i i = _mm_cvtps_epi32(x); // round to nearest
+	const __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+	__m128 p = _mm_set1_ps(1.535336188319500e-4f);
+	p = _fast_madd_ps(p, f, _mm_set1_ps(1.339887440266574e-3f));
+	p = _fast_madd_ps(p, f, _mm_set1_ps(9.618437357674640e-3f));
+	p = _fast_madd_ps(p, f, _mm_set1_ps(5.550332471162809e-2f));
+	p = _fast_madd_ps(p, f, _mm_set1_ps(2.402264791363012e-1f));
+	p = _fast_madd_ps(p, f, _mm_set1_ps(6.931472028550421e-1f));
+	p = _fast_madd_ps(p, f, _mm_set1_ps(1.0f));
+	// 2^i in the exponent bits; i = -127 gives 0
+	const __m128 e = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+	return _mm_mul_ps(p, e);
+}
+
+static inline __m128 fast_log2_ps(__m128 x)
+{
+	const __m128i bits = _mm_castps_si128(x);
+	const __m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_set1_epi32(0x3f800000)));
+	// m in [1, 2); above sqrt(2), halve it and count one more
+	const __m128 big = _mm_cmpgt_ps(m, _mm_set1_ps(1.41421356f));
+	m = _mm_sub_ps(m, _mm_and_ps(big, _mm_mul_ps(m, _mm_set1_ps(0.5f))));
+	const __m128 ef = _mm_add_ps(_mm_cvtepi32_ps(e), _mm_and_ps(big, _mm_set1_ps(1.0f)));
+	const __m128 t = _mm_sub_ps(m, _mm_set1_ps(1.0f));
+	const __m128 z = _mm_mul_ps(t, t);
+	__m128 p = _mm_set1_ps(7.0376836292e-2f);
+	p = _fast_madd_ps(p, t, _mm_set1_ps(-1.1514610310e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(1.1676998740e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(-1.2420140846e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(1.4249322787e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(-1.6668057665e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(2.0000714765e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(-2.4999993993e-1f));
+	p = _fast_madd_ps(p, t, _mm_set1_ps(3.3333331174e-1f));
+	// ln(1 + t)
+	__m128 y = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(t, z), p), _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+	y = _mm_add_ps(t, y);
+	return _fast_madd_ps(y, _mm_set1_ps(1.44269504f), ef);
+}
+
+static inline __m128 fast_sin_ps(__m128 x)
+{
+	// in turns, to [-1/2, 1/2]
+	__m128 t = _mm_mul_ps(x, _mm_set1_ps(0.159154943f));
+	t = _mm_sub_ps(t, _mm_cvtepi32_ps(_mm_cvtps_epi32(t)));
+	// sin is odd, and symmetric around 1/4
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	const __m128 sign = _mm_and_ps(t, sign_mask);
+	__m128 a = _mm_andnot_ps(sign_mask, t);
+	a = _mm_min_ps(a, _mm_sub_ps(_mm_set1_ps(0.5f), a));
+	const __m128 r = _mm_mul_ps(a, _mm_set1_ps(6.28318531f));
+	const __m128 z = _mm_mul_ps(r, r);
+	__m128 p = _mm_set1_ps(2.5904885796e-6f);
+	p = _fast_madd_ps(p, z, _mm_set1_ps(-1.9800897809e-4f));
+	p = _fast_madd_ps(p, z, _mm_set1_ps(8.3328998243e-3f));
+	p = _fast_madd_ps(p, z, _mm_set1_ps(-1.6666647635e-1f));
+	p = _fast_madd_ps(p, z, _mm_set1_ps(9.9999997659e-1f));
+	return _mm_xor_ps(_mm_mul_ps(p, r), sign);
+}
+
+static inline __m128 fast_semitones_ps(__m128 x)
+{
+	return fast_exp2_ps(_mm_mul_ps(x, _mm_set1_ps(1.0f / 12.0f)));
+}
+
+static inline float fast_exp2f(float x)
+{
+	return _mm_cvtss_f32(fast_exp2_ps(_mm_set_ss(x)));
+}
+
+static inline float fast_log2f(float x)
+{
+	return _mm_cvtss_f32(fast_log2_ps(_mm_set_ss(x)));
 }
 
+static inline float fast_semitonesf(float x)
+{
+	return _mm_cvtss_f32(fast_semitones_ps(_mm_set_ss(x)));
+}
+
+static inline float fast_sinf(float x)
+{
+	return _mm_cvtss_f32(fast_sin_ps(_mm_set_ss(x)));
+}
 
 static inline float slope_coef(float rate, float slope)
 {
@@ -36,7 +161,7 @@ static inline float slope_coef(float rate, float slope)
 
 static inline float note_to_hz(float base_hz, float note)
 {
-	return base_hz * powf(2.0f, note / 12.0f);
+	return base_hz * fast_semitonesf(note);
 }
 
 static inline float clampf(float x, float min, float max)
@@ -52,3 +177,12 @@ static inline float randf(float min, float max)
 	return min + r * (max - min);
 }
 
+/*
+sets flush-to-zero and denormals-are-zero in the calling thread's MXCSR, so
+that signals decaying towards silence never hit the (very slow) denormal
+paths of the FPU. call it on every thread that renders.
+*/
+static inline void disable_denormals()
+{
+	_mm_setcsr(_mm_getcsr() | 0x8040); // FTZ | DAZ
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <emmintrin.h>
+
+#include "Math.h"
+#include "assert.h"
+
+/*
+audio-rate modulation. sources render one value per output frame into a
+buffer, a block at a time, four frames per step with SSE; components take
+those buffers as block inputs with modulate() (SkaarOsc: pitch and shift,
+F6581: fc and q), convert them in one pass, and step through them a frame
+at a time in next_frame(), which the oversamplers call.
+
+so a smooth sweep costs a buffer pass per block, instead of a scheduled
+event (and a stepped parameter) every so many frames.
+
+  Lfo          sine, triangle or saw; offset + depth * shape, shape in
+               [-1, 1]
+  Automation   breakpoints (frame, value), linear in between, held
+               before the first and after the last
+
+neither allocates. MOD_BLOCK is the most frames a component takes per
+modulate() call.
+*/
+
+static const int MOD_BLOCK = 256;
+
+struct Lfo {
+	enum {
+		SINE = 0,
+		TRIANGLE,
+		SAW
+	};
+
+	int shape = SINE;
+	float hz = 1.0f;
+	float depth = 1.0f;
+	float offset = 0.0f;
+	// in turns; double, so that slow rates don't drift
+	double phase = 0.0;
+	float sample_rate = 0.0f;
+
+	void set_sample_rate(float value)
+	{
+		sample_rate = value;
+	}
+
+	void render(float* out, int n)
+	{
+		const double inc = (double)hz / (double)sample_rate;
+		const __m128 lane = _mm_mul_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps((float)inc));
+		const __m128 vdepth = _mm_set1_ps(depth);
+		const __m128 voffset = _mm_set1_ps(offset);
+		int i = 0;
+		for (; i + 4 <= n; i += 4) {
+			__m128 t = _mm_add_ps(_mm_set1_ps((float)phase), lane);
+			_mm_storeu_ps(out + i, _mm_add_ps(voffset, _mm_mul_ps(vdepth, _shape_ps(t))));
+			_advance(inc * 4.0);
+		}
+		for (; i < n; i++) {
+			out[i] = _mm_cvtss_f32(_mm_add_ss(voffset, _mm_mul_ss(vdepth, _shape_ps(_mm_set_ss((float)phase)))));
+			_advance(inc);
+		}
+	}
+
+	inline void _advance(double d)
+	{
+		phase += d;
+		if (phase >= 1.0) phase -= floor(phase);
+	}
+
+	// t in turns, [0, 2)
+	inline __m128 _shape_ps(__m128 t)
+	{
+		switch (shape) {
+		case TRIANGLE: {
+			// 1 - 4 * |x - 1/2| over x = t + 1/4 wrapped, so it starts at 0 going up
+			__m128 x = _mm_add_ps(t, _mm_set1_ps(0.25f));
+			x = _mm_sub_ps(x, _mm_cvtepi32_ps(_mm_cvttps_epi32(x)));
+			const __m128 d = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(x, _mm_set1_ps(0.5f)));
+			return _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(d, _mm_set1_ps(4.0f)));
+		}
+		case SAW: {
+			__m128 x = _mm_add_ps(t, _mm_set1_ps(0.5f));
+			x = _mm_sub_ps(x, _mm_cvtepi32_ps(_mm_cvttps_epi32(x)));
+			return _mm_sub_ps(_mm_mul_ps(x, _mm_set1_ps(2.0f)), _mm_set1_ps(1.0f));
+		}
+		default:
+			return fast_sin_ps(_mm_mul_ps(t, _mm_set1_ps(6.28318531f)));
+		}
+	}
+};
+
+struct Automation {
+	static constexpr int MAX_POINTS = 64;
+
+	struct Point {
+		int64_t t;
+		float value;
+	};
+
+	Point points[MAX_POINTS];
+	int n_points = 0;
+	// frames rendered so far, and the segment they're in
+	int64_t t = 0;
+	int _segment = 0;
+
+	// t in frames from the start of rendering, not before the last point
+	void add(int64_t at, float value)
+	{
+		ASSERT(n_points < MAX_POINTS);
+		ASSERT(n_points == 0 || at >= points[n_points - 1].t);
+		points[n_points].t = at;
+		points[n_points].value = value;
+		n_points++;
+	}
+
+	void clear()
+	{
+		n_points = 0;
+		_segment = 0;
+	}
+
+	void seek(int64_t at)
+	{
+		t = at;
+		_segment = 0;
+	}
+
+	void render(float* out, int n)
+	{
+		ASSERT(n_points > 0);
+		while (n > 0) {
+			while (_segment < n_points && points[_segment].t <= t) _segment++;
+			if (_segment == 0 || _segment == n_points) {
+				// before the first point or after the last
+				const float v = points[_segment == 0 ? 0 : n_points - 1].value;
+				int m = n;
+				if (_segment == 0 && points[0].t - t < m) m = points[0].t - t;
+				for (int i = 0; i < m; i++) out[i] = v;
+				out += m;
+				n -= m;
+				t += m;
+				continue;
+			}
+			const Point& a = points[_segment - 1];
+			const Point& b = points[_segment];
+			const float slope = (b.value - a.value) / (float)(b.t - a.t);
+			int m = n;
+			if (b.t - t < m) m = b.t - t;
+			// value at each frame from the segment's start, so nothing
+			// accumulates
+			const float x0 = (float)(t - a.t);
+			const __m128 vslope = _mm_set1_ps(slope);
+			const __m128 va = _mm_set1_ps(a.value);
+			__m128 x = _mm_add_ps(_mm_set1_ps(x0), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+			int i = 0;
+			for (; i + 4 <= m; i += 4) {
+				_mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(vslope, x)));
+				x = _mm_add_ps(x, _mm_set1_ps(4.0f));
+			}
+			for (; i < m; i++) out[i] = a.value + slope * (x0 + (float)i);
+			out += m;
+			n -= m;
+			t += m;
+		}
+	}
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+adaptive quality: under CPU pressure, lose some quality rather than miss the
+deadline. components with a set_quality(level) have cheaper variants of
+their inner loops for the lower levels:
+
+  QUALITY_HIGH    everything as designed
+  QUALITY_MEDIUM  cheaper math where the error stays far below the signal
+                  (F6581's exp), half-width interpolation kernels
+                  (PolyphaseSmplr)
+  QUALITY_LOW     linear interpolation (PolyphaseSmplr); aliases audibly
+
+switching is click-free: components crossfade between their old and new
+variant over QUALITY_XFADE frames, or, where there's no second output to
+fade to (a filter has one state), switch to a variant close enough to be
+continuous.
+
+QualityGovernor picks the level from the measured load (render time over
+its budget) of every render. a render above `high` steps down right away,
+at most once per `settle` seconds so the previous step gets to show its
+effect; a smoothed load below `low` for `recover` seconds steps back up.
+the gap between the two keeps it from oscillating.
+
+programs read get_level() once per callback and pass it on to their voices;
+set_quality() with an unchanged level costs nothing. the governor is off
+unless enabled (-q in main_sdl.h), so renders are deterministic by default.
+QUALITY=<level> in the environment pins a level instead, for listening to
+it or comparing renders.
+*/
+
+enum {
+	QUALITY_HIGH = 0,
+	QUALITY_MEDIUM,
+	QUALITY_LOW,
+	QUALITY_LEVELS
+};
+
+static const int QUALITY_XFADE = 256; // frames
+
+struct QualityGovernor {
+	float high = 0.8f;
+	float low = 0.4f;
+	float settle = 0.05f;
+	float recover = 2.0f;
+	bool enabled = false;
+
+	std::atomic<int> level{QUALITY_HIGH};
+	std::atomic<uint64_t> steps_down{0};
+
+	// render thread only
+	double smoothed = 0.0;
+	int64_t since_step_ns = 0;
+	int64_t calm_ns = 0;
+
+	QualityGovernor()
+	{
+		const char* pin = getenv("QUALITY");
+		if (pin != nullptr) {
+			int l = atoi(pin);
+			level.store(l < 0 ? 0 : l >= QUALITY_LEVELS ? QUALITY_LEVELS - 1 : l);
+		}
+	}
+
+	QualityGovernor(QualityGovernor const&) = delete;
+	void operator=(QualityGovernor const&) = delete;
+
+	static QualityGovernor& get_instance()
+	{
+		static QualityGovernor instance;
+		return instance;
+	}
+
+	inline int get_level()
+	{
+		return level.load(std::memory_order_relaxed);
+	}
+
+	// after every render; ns is the time it took, budget_ns the time it
+	// covers
+	void update(int64_t ns, int64_t budget_ns)
+	{
+		if (!enabled || budget_ns <= 0) return;
+		double load = (double)ns / (double)budget_ns;
+		smoothed += (load - smoothed) * 0.05;
+		since_step_ns += budget_ns;
+
+		int l = get_level();
+		if (load > high) {
+			calm_ns = 0;
+			if (l < QUALITY_LEVELS - 1 && since_step_ns >= (int64_t)(settle * 1e9f)) {
+				level.store(l + 1, std::memory_order_relaxed);
+				steps_down.fetch_add(1, std::memory_order_relaxed);
+				since_step_ns = 0;
+			}
+		} else if (smoothed < low) {
+			calm_ns += budget_ns;
+			if (l > QUALITY_HIGH && calm_ns >= (int64_t)(recover * 1e9f)) {
+				level.store(l - 1, std::memory_order_relaxed);
+				since_step_ns = 0;
+				calm_ns = 0;
+			}
+		} else {
+			calm_ns = 0;
+		}
+	}
+};
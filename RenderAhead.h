@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "assert.h"
+
+/*
+renders ahead of the audio device on a thread of its own. the render thread
+calls render() a block at a time and writes into a lock-free single
+producer/single consumer ring of interleaved float frames, keeping it
+ahead_blocks blocks full; the device callback only copies out of the ring
+with read(). rendering jitter is absorbed by the fill level, at the cost of
+ahead_blocks * block frames of extra latency; set_ahead() trades one for the
+other at any time.
+
+when the ring can't cover a read() the missing frames are played as silence
+and counted as an underrun. the audio side never blocks or makes syscalls;
+the render thread polls the fill level with short sleeps.
+*/
+struct RenderAhead {
+	typedef void (*RenderFn)(void* ctx, float* out, int n);
+
+	int channels;
+	int block;
+	float sample_rate;
+	uint32_t capacity; // frames, a power of two
+	uint32_t mask;
+	float* ring;
+	float* scratch;
+
+	RenderFn render;
+	void* ctx;
+
+	std::atomic<uint64_t> write_pos{0};
+	std::atomic<uint64_t> read_pos{0};
+	std::atomic<int> ahead_blocks;
+	std::atomic<uint64_t> underruns{0};
+	std::atomic<uint64_t> underrun_frames{0};
+	std::atomic<bool> running{false};
+	std::thread thread;
+
+	RenderAhead(int channels, int block, float sample_rate, int max_ahead_blocks, RenderFn render, void* ctx)
+		: channels(channels), block(block), sample_rate(sample_rate), render(render), ctx(ctx)
+	{
+		ASSERT(block > 0 && max_ahead_blocks > 0);
+		capacity = 1;
+		while (capacity < (uint32_t)(block * (max_ahead_blocks + 1))) capacity <<= 1;
+		mask = capacity - 1;
+		ring = (float*) calloc((size_t)capacity * channels, sizeof(float));
+		scratch = (float*) malloc(sizeof(float) * block * channels);
+		AN(ring);
+		AN(scratch);
+		ahead_blocks.store(max_ahead_blocks);
+	}
+
+	RenderAhead(RenderAhead const&) = delete;
+	void operator=(RenderAhead const&) = delete;
+
+	~RenderAhead()
+	{
+		stop();
+		free(ring);
+		free(scratch);
+	}
+
+	int get_max_ahead()
+	{
+		return capacity / block - 1;
+	}
+
+	void set_ahead(int blocks)
+	{
+		if (blocks < 1) blocks = 1;
+		if (blocks > get_max_ahead()) blocks = get_max_ahead();
+		ahead_blocks.store(blocks);
+	}
+
+	// added latency in frames (at the current setting)
+	int get_latency()
+	{
+		return ahead_blocks.load() * block;
+	}
+
+	void start()
+	{
+		ASSERT(!running.load());
+		running.store(true);
+		thread = std::thread([this]() { _run(); });
+	}
+
+	void stop()
+	{
+		if (!running.load()) return;
+		running.store(false);
+		thread.join();
+	}
+
+	void _run()
+	{
+		// poll at a quarter block
+		struct timespec nap;
+		nap.tv_sec = 0;
+		nap.tv_nsec = (long)((double)block * 1e9 / (double)sample_rate / 4.0);
+
+		while (running.load(std::memory_order_relaxed)) {
+			uint64_t w = write_pos.load(std::memory_order_relaxed);
+			uint64_t r = read_pos.load(std::memory_order_acquire);
+			uint64_t target = (uint64_t)ahead_blocks.load(std::memory_order_relaxed) * block;
+			if (w - r + block > target) {
+				nanosleep(&nap, NULL);
+				continue;
+			}
+
+			render(ctx, scratch, block);
+			for (int i = 0; i < block; ) {
+				uint32_t at = (w + i) & mask;
+				int m = block - i;
+				if (m > (int)(capacity - at)) m = capacity - at;
+				memcpy(ring + (size_t)at * channels, scratch + (size_t)i * channels, sizeof(float) * m * channels);
+				i += m;
+			}
+			write_pos.store(w + block, std::memory_order_release);
+		}
+	}
+
+	// device side; n frames into out
+	void read(float* out, int n)
+	{
+		uint64_t r = read_pos.load(std::memory_order_relaxed);
+		uint64_t w = write_pos.load(std::memory_order_acquire);
+		int avail = (int)(w - r);
+		int m = n < avail ? n : avail;
+		for (int i = 0; i < m; ) {
+			uint32_t at = (r + i) & mask;
+			int k = m - i;
+			if (k > (int)(capacity - at)) k = capacity - at;
+			memcpy(out + (size_t)i * channels, ring + (size_t)at * channels, sizeof(float) * k * channels);
+			i += k;
+		}
+		if (m < n) {
+			memset(out + (size_t)m * channels, 0, sizeof(float) * (n - m) * channels);
+			underruns.fetch_add(1, std::memory_order_relaxed);
+			underrun_frames.fetch_add(n - m, std::memory_order_relaxed);
+		}
+		read_pos.store(r + m, std::memory_order_release);
+	}
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <xmmintrin.h>
+
+#include "Bus.h"
+#include "Math.h"
+#include "BusBuffer.h"
+#include "assert.h"
+
+/*
+a fixed pool of worker threads that runs a block's worth of independent
+render tasks (voices, instrument chains) in parallel.
+
+run() splits the task indices into one contiguous range per thread. a thread
+takes tasks from the front of its own range; when that runs dry it steals
+tasks one at a time from the back of the others. ranges are packed
+(begin, end) pairs in one 64-bit atomic each, so taking and stealing are
+single CASes, and only run() ever stores a range outright (a worker that is
+late to notice a block has ended can then at worst pick up tasks of the next
+one, which is harmless). the calling (audio) thread works too and then spins
+until every task is done.
+
+workers spin for a while after a block before sleeping on a futex, so at
+callback rates they are normally awake when the next block arrives; the
+caller only makes the wake syscall if someone is actually asleep. nothing is
+locked or allocated after construction. workers are pinned to CPUs 1..n-1,
+leaving the caller (the audio thread) where it is.
+
+PoolMixer renders each task into a buffer of its own and sums them into the
+output in task order, so the mix is bit-identical no matter which thread ran
+which task.
+*/
+struct RenderPool {
+	static constexpr int MAX_THREADS = 64;
+	static constexpr int SPIN = 1 << 16;
+
+	typedef void (*TaskFn)(void* ctx, int task);
+
+	// padded to a cache line each (alignas would make the pool over-aligned,
+	// which plain new doesn't honor in C++11)
+	struct Slot {
+		std::atomic<uint64_t> range{0};
+		char _pad[64 - sizeof(std::atomic<uint64_t>)];
+	};
+
+	int n_threads; // workers + the caller
+	Slot slots[MAX_THREADS];
+	std::thread threads[MAX_THREADS];
+
+	std::atomic<uint32_t> generation{0};
+	char _pad0[64];
+	std::atomic<int> sleepers{0};
+	char _pad1[64];
+	std::atomic<int> remaining{0};
+	char _pad2[64];
+	std::atomic<bool> quit{false};
+
+	TaskFn fn;
+	void* ctx;
+
+	static inline uint64_t _pack(uint32_t begin, uint32_t end)
+	{
+		return (uint64_t)begin | ((uint64_t)end << 32);
+	}
+
+	static int get_num_cpus()
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		return n > 0 ? (int)n : 1;
+	}
+
+	// n_workers doesn't count the caller; -1 means one per remaining CPU
+	RenderPool(int n_workers = -1)
+	{
+		if (n_workers < 0) n_workers = get_num_cpus() - 1;
+		n_threads = n_workers + 1;
+		ASSERT(n_threads <= MAX_THREADS);
+		for (int i = 1; i < n_threads; i++) {
+			threads[i] = std::thread([this, i]() { _worker(i); });
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(i % get_num_cpus(), &set);
+			// best effort; fails in restricted cpusets
+			pthread_setaffinity_np(threads[i].native_handle(), sizeof(set), &set);
+		}
+	}
+
+	RenderPool(RenderPool const&) = delete;
+	void operator=(RenderPool const&) = delete;
+
+	~RenderPool()
+	{
+		quit.store(true);
+		generation.fetch_add(1, std::memory_order_release);
+		_wake();
+		for (int i = 1; i < n_threads; i++) {
+			threads[i].join();
+		}
+	}
+
+	void _wake()
+	{
+		syscall(SYS_futex, (uint32_t*)&generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+
+	int _take(int self)
+	{
+		Slot& s = slots[self];
+		uint64_t r = s.range.load(std::memory_order_acquire);
+		while (true) {
+			uint32_t begin = r & 0xffffffff, end = r >> 32;
+			if (begin >= end) return -1;
+			if (s.range.compare_exchange_weak(r, _pack(begin + 1, end), std::memory_order_acquire)) {
+				return begin;
+			}
+		}
+	}
+
+	int _steal(int self)
+	{
+		for (int k = 1; k < n_threads; k++) {
+			Slot& victim = slots[(self + k) % n_threads];
+			uint64_t r = victim.range.load(std::memory_order_acquire);
+			while (true) {
+				uint32_t begin = r & 0xffffffff, end = r >> 32;
+				if (begin >= end) break;
+				if (victim.range.compare_exchange_weak(r, _pack(begin, end - 1), std::memory_order_acquire)) {
+					return end - 1;
+				}
+			}
+		}
+		return -1;
+	}
+
+	void _work(int self)
+	{
+		while (true) {
+			int task = _take(self);
+			if (task < 0) task = _steal(self);
+			if (task < 0) return;
+			fn(ctx, task);
+			remaining.fetch_sub(1, std::memory_order_acq_rel);
+		}
+	}
+
+	void _worker(int self)
+	{
+		disable_denormals();
+		uint32_t seen = 0;
+		while (true) {
+			uint32_t g = generation.load(std::memory_order_acquire);
+			for (int i = 0; i < SPIN && g == seen; i++) {
+				_mm_pause();
+				g = generation.load(std::memory_order_acquire);
+			}
+			if (g == seen) {
+				sleepers.fetch_add(1);
+				syscall(SYS_futex, (uint32_t*)&generation, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+				sleepers.fetch_sub(1);
+				continue;
+			}
+			seen = g;
+			if (quit.load()) return;
+			_work(self);
+		}
+	}
+
+	// runs fn(ctx, 0..n_tasks-1) across the pool and returns when all are done
+	void run(int n_tasks, TaskFn fn_, void* ctx_)
+	{
+		if (n_tasks <= 0) return;
+		fn = fn_;
+		ctx = ctx_;
+		remaining.store(n_tasks, std::memory_order_relaxed);
+		for (int i = 0; i < n_threads; i++) {
+			uint32_t begin = (uint64_t)n_tasks * i / n_threads;
+			uint32_t end = (uint64_t)n_tasks * (i + 1) / n_threads;
+			slots[i].range.store(_pack(begin, end), std::memory_order_release);
+		}
+		generation.fetch_add(1, std::memory_order_release);
+		if (sleepers.load() > 0) _wake();
+
+		_work(0);
+		while (remaining.load(std::memory_order_acquire) > 0) {
+			_mm_pause();
+		}
+	}
+};
+
+template <typename BUS, int MAX_TASKS, int MAX_BLOCK = 1024>
+struct PoolMixer {
+	typedef void (*RenderFn)(void* ctx, int task, BUS* out, int n);
+
+	RenderPool* pool;
+	BUS* scratch; // [MAX_TASKS][MAX_BLOCK]
+	RenderFn render_fn;
+	void* render_ctx;
+	int n;
+
+	PoolMixer(RenderPool* pool) : pool(pool)
+	{
+		scratch = (BUS*) aligned_alloc(64, sizeof(BUS) * MAX_TASKS * MAX_BLOCK);
+		AN(scratch);
+	}
+
+	PoolMixer(PoolMixer const&) = delete;
+	void operator=(PoolMixer const&) = delete;
+
+	~PoolMixer()
+	{
+		free(scratch);
+	}
+
+	static void _task(void* ctx, int task)
+	{
+		PoolMixer* self = (PoolMixer*) ctx;
+		self->render_fn(self->render_ctx, task, self->scratch + (size_t)task * MAX_BLOCK, self->n);
+	}
+
+	// renders n_tasks tasks of n frames each in parallel and sums them into
+	// out, in task order
+	void render(BUS* out, int n_frames, int n_tasks, RenderFn fn, void* ctx)
+	{
+		ASSERT(n_frames <= MAX_BLOCK && n_tasks <= MAX_TASKS);
+		render_fn = fn;
+		render_ctx = ctx;
+		n = n_frames;
+		pool->run(n_tasks, _task, this);
+
+		bus_zero(out, n_frames);
+		for (int t = 0; t < n_tasks; t++) {
+			bus_mix(out, scratch + (size_t)t * MAX_BLOCK, 1, n_frames);
+		}
+	}
+};
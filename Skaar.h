@@ -1,8 +1,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <emmintrin.h>
 
 #include "Math.h"
+#include "Mod.h"
+#include "CallbackStats.h"
+#include "Quality.h"
+#include "assert.h"
 
 template <typename ENV, int WAVETABLE_SIZE_EXP = 8>
 struct SkaarOsc
@@ -34,12 +39,69 @@ struct SkaarOsc
 	float gain_filter = 0.0f;
 	ENV env;
 
+	// a change keeps the pitch
 	void set_sample_rate(float value)
 	{
+		if (sample_rate > 0.0f) {
+			inc = (double)inc * (double)sample_rate / (double)value;
+			inc_set = (double)inc_set * (double)sample_rate / (double)value;
+		}
 		sample_rate = value;
 		env.set_sample_rate(value);
 	}
 
+	/*
+	audio-rate pitch and shift (see Mod.h): for the next n output frames,
+	a pitch offset in semitones from the set_hz() pitch and a shift (-1 to
+	1, in place of set_shift()'s) per frame, either of them null to leave
+	it alone. both are converted four at a time (the pitch to a ratio with
+	fast_semitones_ps()), and next_frame() applies a frame's worth. the
+	last shift holds afterwards; the pitch goes back to the set one when
+	a block comes without it
+	*/
+	uint32_t inc_set = 0; // inc as set_hz() left it
+	float _mod_ratio[MOD_BLOCK];
+	int32_t _mod_shift[MOD_BLOCK];
+	bool _mod_pitch = false;
+	bool _mod_shifts = false;
+	int _mod_i = 0;
+	int _mod_n = 0;
+
+	void modulate(const float* pitch, const float* shift_in, int n)
+	{
+		ASSERT(n > 0 && n <= MOD_BLOCK);
+		if (_mod_pitch && pitch == nullptr) inc = inc_set;
+		_mod_i = 0;
+		_mod_n = n;
+		_mod_pitch = pitch != nullptr;
+		_mod_shifts = shift_in != nullptr;
+		int i;
+		if (pitch != nullptr) {
+			for (i = 0; i + 4 <= n; i += 4) {
+				_mm_storeu_ps(_mod_ratio + i, fast_semitones_ps(_mm_loadu_ps(pitch + i)));
+			}
+			for (; i < n; i++) _mod_ratio[i] = fast_semitonesf(pitch[i]);
+		}
+		if (shift_in != nullptr) {
+			const __m128 lo = _mm_set1_ps(-1.0f);
+			const __m128 hi = _mm_set1_ps(1.0f);
+			const __m128 period = _mm_set1_ps((float)PERIOD);
+			for (i = 0; i + 4 <= n; i += 4) {
+				const __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(shift_in + i), lo), hi);
+				_mm_storeu_si128((__m128i*)(_mod_shift + i), _mm_cvttps_epi32(_mm_mul_ps(v, period)));
+			}
+			for (; i < n; i++) _mod_shift[i] = clampf(shift_in[i], -1.0f, 1.0f) * PERIOD;
+		}
+	}
+
+	inline void next_frame()
+	{
+		if (_mod_i >= _mod_n) return;
+		if (_mod_pitch) inc = (float)inc_set * _mod_ratio[_mod_i];
+		if (_mod_shifts) shift = _mod_shift[_mod_i];
+		_mod_i++;
+	}
+
 	void set_shift(float value)
 	{
 		shift = clampf(value, -1.0f, 1.0f) * PERIOD;
@@ -110,6 +172,12 @@ struct SkaarOsc
 		return out;
 	}
 
+	// silent until the next note-on
+	bool idle()
+	{
+		return (flags & OFF) || env.idle();
+	}
+
 	inline float sample()
 	{
 		if (flags & OFF) {
@@ -120,7 +188,7 @@ struct SkaarOsc
 
 	void set_hz(float hz)
 	{
-		inc = (float)PERIOD * hz / sample_rate;
+		inc = inc_set = (float)PERIOD * hz / sample_rate;
 	}
 
 
@@ -144,32 +212,126 @@ struct Skaar
 	FILTER filter;
 	float gain = 1.0f;
 
+	/*
+	once every oscillator is idle and the filter output has stayed within
+	SLEEP_THRESHOLD of one value for SLEEP_TIME seconds, the voice sleeps:
+	sample() returns that value (the filter settles on a DC offset, not
+	necessarily zero) without running oscillators or filter, until an
+	oscillator leaves idle again. oscillator phases don't advance while
+	asleep. can_sleep = false keeps the voice running instead (benches
+	time tails that way).
+	*/
+	static constexpr float SLEEP_THRESHOLD = 1e-5f;
+	static constexpr float SLEEP_TIME = 0.01f;
+	int _sleep_after = 0;
+	int _quiet = 0;
+	float _quiet_value = 0.0f;
+	bool _sleeping = false;
+	bool can_sleep = true;
+
 	void set_sample_rate(float sample_rate)
 	{
 		for (auto& o : osc) {
 			o.set_sample_rate(sample_rate);
 		}
 		filter.set_sample_rate(sample_rate);
+		_sleep_after = SLEEP_TIME * sample_rate;
 	}
 
-	inline float sample()
+	int _quality = QUALITY_HIGH;
+
+	void set_quality(int level)
 	{
-		auto* oprev = &osc[OSC_COUNT - 1];
+		_quality = level;
+		filter.set_quality(level);
+	}
+
+	/*
+	the oversampling ratio (a power of two, up to max_ratio) this voice
+	needs at an output rate of output_rate, for DynFirOversampler: enough
+	that harmonics up to ALIAS_HARMONIC of the highest sounding oscillator
+	don't alias back into the output band, or max_ratio with hard sync
+	(the resets are discontinuities no matter the pitch), and at least
+	what the filter needs to keep its voicing. each quality level below
+	QUALITY_HIGH halves the oscillators' share (never the filter's).
+	idle oscillators don't count
+	*/
+	static constexpr float ALIAS_HARMONIC = 880.0f;
+
+	int wanted_ratio(float output_rate, int max_ratio)
+	{
+		float hz = 0.0f;
 		for (auto& o : osc) {
-			o.apply_hard_sync(oprev);
-			oprev = &o;
+			if (o.idle()) continue;
+			if (o.flags & OSC::SYN) return max_ratio;
+			const float h = (float)o.inc * o.sample_rate * (1.0f / (float)OSC::PERIOD);
+			if (h > hz) hz = h;
+		}
+		// a harmonic at f aliases to ratio * output_rate - f
+		float need = (ALIAS_HARMONIC * hz + output_rate * 0.5f) / output_rate / (float)(1 << _quality);
+		const float filter_need = filter.min_sample_rate() / output_rate;
+		if (filter_need > need) need = filter_need;
+		int ratio = 1;
+		while (ratio < max_ratio && (float)ratio < need) ratio <<= 1;
+		return ratio;
+	}
+
+	// see Mod.h; once per output frame, from the oversampler
+	inline void next_frame()
+	{
+		for (auto& o : osc) o.next_frame();
+		filter.next_frame();
+	}
+
+	inline bool _all_idle()
+	{
+		for (auto& o : osc) {
+			if (!o.idle()) return false;
+		}
+		return true;
+	}
+
+	bool sleeping()
+	{
+		return _sleeping && _all_idle();
+	}
+
+	inline float sample()
+	{
+		if (_sleeping) {
+			if (_all_idle()) return _quiet_value * gain;
+			_sleeping = false;
+			_quiet = 0;
 		}
 
 		float vf_out = 0.0f;
 		float vf_filter = 0.0f;
-		for (auto& o : osc) {
-			float vf = o.sample();
-			vf_out += vf * o.gain;
-			vf_filter += vf * o.gain_filter;
+		{
+			CBS_STAGE(CBS_STAGE_VOICES);
+
+			auto* oprev = &osc[OSC_COUNT - 1];
+			for (auto& o : osc) {
+				o.apply_hard_sync(oprev);
+				oprev = &o;
+			}
+
+			for (auto& o : osc) {
+				float vf = o.sample();
+				vf_out += vf * o.gain;
+				vf_filter += vf * o.gain_filter;
+			}
 		}
 
+		CBS_STAGE(CBS_STAGE_FILTER);
 		float vf = filter.sample(vf_out, vf_filter);
 
+		if (fabsf(vf - _quiet_value) >= SLEEP_THRESHOLD || !_all_idle()) {
+			_quiet_value = vf;
+			_quiet = 0;
+		} else if (++_quiet >= _sleep_after && can_sleep) {
+			_sleeping = true;
+		}
+
 		return vf * gain;
 	}
 
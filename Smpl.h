@@ -1,21 +1,190 @@
 #pragma once
 
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
 #include <type_traits>
 
 #include "Bus.h"
+#include "Dsp.h"
+#include "Quality.h"
 #include "Tables.h"
 #include "assert.h"
 
+/*
+storage formats. a Smpl<BUS> may store frames in a narrower type than the
+one it's played back in; SmplFmt<T> converts a stored value to and from
+float; widen() and SCALE split to_float() in two so that a constant scale can
+be applied once after a filter kernel rather than per tap, and widen_span()
+converts a run of values (scaled) with the Dsp.h kernels. s16 and f16 frames
+are half the size of f32 frames (s16 being exact for 16-bit sources, f16
+keeping ~11 bits of mantissa at any level). PolyphaseSmplr widens them a
+span at a time into a float buffer and runs its kernels from there.
+*/
+
+struct f16 {
+	uint16_t bits;
+};
+
+template <typename T>
+struct SmplFmt;
+
+template <>
+struct SmplFmt<float> {
+	static constexpr float SCALE = 1.0f;
+	static inline float widen(float v) { return v; }
+	static inline float to_float(float v) { return v; }
+	static inline float from_float(float v) { return v; }
+	static inline void widen_span(float* dst, const float* src, size_t n) { memcpy(dst, src, sizeof(float) * n); }
+};
+
+template <>
+struct SmplFmt<double> {
+	static constexpr float SCALE = 1.0f;
+	static inline float widen(double v) { return v; }
+	static inline float to_float(double v) { return v; }
+	static inline double from_float(float v) { return v; }
+};
+
+template <>
+struct SmplFmt<int16_t> {
+	static constexpr float SCALE = 1.0f / 32768.0f;
+
+	static inline float widen(int16_t v)
+	{
+		return (float)v;
+	}
+
+	static inline float to_float(int16_t v)
+	{
+		return widen(v) * SCALE;
+	}
+
+	static inline int16_t from_float(float v)
+	{
+		float x = v * 32768.0f;
+		if (x < -32768.0f) x = -32768.0f;
+		if (x > 32767.0f) x = 32767.0f;
+		return (int16_t)lrintf(x);
+	}
+
+	static inline void widen_span(float* dst, const int16_t* src, size_t n)
+	{
+		dsp_get_kernels()->s16_to_f32(dst, src, n);
+	}
+};
+
+template <>
+struct SmplFmt<f16> {
+	static constexpr float SCALE = 1.0f;
+
+	union _fu {
+		float f;
+		uint32_t u;
+	};
+
+	static inline float widen(f16 v)
+	{
+		return to_float(v);
+	}
+
+	// see Dsp.h f16_to_f32
+	static inline float to_float(f16 v)
+	{
+		return _dsp_f16_to_f32(v.bits);
+	}
+
+	static inline void widen_span(float* dst, const f16* src, size_t n)
+	{
+		dsp_get_kernels()->f16_to_f32(dst, (const uint16_t*)src, n);
+	}
+
+	// round to nearest even, saturating at the largest finite half
+	static inline f16 from_float(float v)
+	{
+		_fu x;
+		x.f = v;
+		uint16_t sign = (x.u >> 16) & 0x8000;
+		uint32_t u = x.u & 0x7fffffff;
+		f16 r;
+		if (u >= 0x477ff000) {
+			r.bits = sign | 0x7bff;
+		} else if (u < 0x38800000) {
+			x.u = u;
+			r.bits = sign | (uint16_t)lrintf(x.f * 16777216.0f); // 2^24
+		} else {
+			u += ((uint32_t)(15 - 127) << 23) + 0xfff + ((u >> 13) & 1);
+			r.bits = sign | (uint16_t)(u >> 13);
+		}
+		return r;
+	}
+};
+
+template <typename BUS, typename STORE>
+static inline BUS smpl_widen(STORE s)
+{
+	static_assert(BUS::CH == STORE::CH, "channel count mismatch");
+	BUS r;
+	for (int i = 0; i < BUS::CH; i++) {
+		r.value[i] = SmplFmt<typename STORE::T>::to_float(s.value[i]);
+	}
+	return r;
+}
+
+// like smpl_widen(), but leaves SmplFmt<>::SCALE to the caller
+template <typename BUS, typename STORE>
+static inline BUS smpl_widen_unscaled(STORE s)
+{
+	static_assert(BUS::CH == STORE::CH, "channel count mismatch");
+	BUS r;
+	for (int i = 0; i < BUS::CH; i++) {
+		r.value[i] = SmplFmt<typename STORE::T>::widen(s.value[i]);
+	}
+	return r;
+}
+
+template <typename STORE, typename BUS>
+static inline STORE smpl_narrow(BUS s)
+{
+	static_assert(BUS::CH == STORE::CH, "channel count mismatch");
+	STORE r;
+	for (int i = 0; i < BUS::CH; i++) {
+		r.value[i] = SmplFmt<typename STORE::T>::from_float(s.value[i]);
+	}
+	return r;
+}
+
+typedef Bus<int16_t, 1> S16Mono;
+typedef Bus<int16_t, 2> S16Stereo;
+typedef Bus<f16, 1> F16Mono;
+typedef Bus<f16, 2> F16Stereo;
+
+
+/*
+a loop is the frames [loop_start, loop_start + loop_length), which must be
+followed by LOOP_GUARD frames repeating the start of the loop (they're
+included in frames). the loop always runs forwards; ping-pong and backward
+loops are unrolled into it when built (see SmplBx_LoopLayout). Smplr wraps
+the position LOOP_LEAD frames past the loop end, so an interpolation kernel
+of up to LOOP_LEAD frames on each side reads contiguous frames, before the
+wrap from the guard and after it from inside the loop. loop_length == 0
+means the sample doesn't loop.
+*/
 template <typename BUS>
 struct Smpl {
 	static_assert(std::is_pod<BUS>::value, "typename 'BUS' is not POD");
 
 	static constexpr float DEFAULT_SAMPLE_RATE = 44100;
 	static constexpr float DEFAULT_BASE = 440;
+	static constexpr int LOOP_GUARD = 32;
+	static constexpr int LOOP_LEAD = 16;
 
 	uint64_t frames;
 	float sample_rate;
 	float base;
+	uint64_t loop_start;
+	uint64_t loop_length;
 
 	BUS data[1];
 
@@ -38,6 +207,8 @@ struct Smpl {
 		ptr->frames = frames;
 		ptr->sample_rate = DEFAULT_SAMPLE_RATE;
 		ptr->base = DEFAULT_BASE;
+		ptr->loop_start = 0;
+		ptr->loop_length = 0;
 		return ptr;
 	}
 
@@ -52,13 +223,17 @@ struct Smpl {
 };
 
 static_assert(std::is_pod<Smpl<FloatStereo>>::value, "Smpl is not POD");
+static_assert(std::is_pod<Smpl<F16Stereo>>::value, "Smpl is not POD");
 
 
-template <typename BUS>
+// STORE is the frame type of the Smpl, BUS the one frames are played back in
+template <typename BUS, typename STORE = BUS>
 struct Smplr {
 	static constexpr int FRAC_EXP = 20;
 
-	Smpl<BUS>* smpl = nullptr;
+	typedef Smpl<STORE> SMPL;
+
+	Smpl<STORE>* smpl = nullptr;
 
 	int32_t inc_fx = 0;
 	int64_t pos_fx = 0;
@@ -87,67 +262,301 @@ struct Smplr {
 		inc_fx = inc * (1 << FRAC_EXP);
 	}
 
+	// wraps at most once per call, so the increment must stay below the
+	// loop length (at least LOOP_GUARD frames). not looping is a loop of
+	// length zero, which never moves the position
 	void advance()
 	{
 		pos_fx += inc_fx;
+		const int64_t loop_length_fx = (int64_t)smpl->loop_length << FRAC_EXP;
+		const int64_t wrap_fx = (int64_t)(smpl->loop_start + smpl->loop_length + Smpl<STORE>::LOOP_LEAD) << FRAC_EXP;
+		pos_fx -= loop_length_fx & -(int64_t)(pos_fx >= wrap_fx);
+	}
+
+	// true once a non-looping sample has played past its end (with
+	// LOOP_LEAD frames of slack for interpolation kernels to ring out)
+	bool ended()
+	{
+		if (smpl->loop_length > 0) return false;
+		const int64_t p = pos();
+		return (inc_fx >= 0) ? (p >= (int64_t)smpl->frames + Smpl<STORE>::LOOP_LEAD) : (p < -Smpl<STORE>::LOOP_LEAD);
+	}
+
+	// an ended sampler only outputs silence, and no longer moves until
+	// set_pos() or set_hz() turn it around
+	bool sleeping()
+	{
+		return smpl == nullptr || ended();
 	}
 
 };
 
-template <typename BUS, int SINC_WIDTH_EXP = 3, int SINC_PHASES_EXP = 12>
-struct PolyphaseSmplr : public Smplr<BUS> {
+template <typename BUS, int SINC_WIDTH_EXP = 3, int SINC_PHASES_EXP = 12, typename STORE = BUS>
+struct PolyphaseSmplr : public Smplr<BUS, STORE> {
 	static constexpr int SINC_WIDTH = 1 << SINC_WIDTH_EXP;
 	static constexpr int SINC_PHASES = 1 << SINC_PHASES_EXP;
 	static constexpr int SINC_MASK = SINC_PHASES - 1;
 
-	static constexpr int OFFSET = -(SINC_WIDTH >> 1) + 1;
 	static constexpr int POS_MIN = -(SINC_WIDTH >> 1) - 1;
 	static constexpr int POS_MAX_OFFSET = (SINC_WIDTH >> 1) - 1;
 
 	typedef BUS T;
 	typedef typename BUS::T Q;
 
-	Q* _pp_kaiser_sinc;
-	Q* _pp_down2x;
-	Q* _pp_down1_333x;
+	// [full, half width][kernel]; half width is for QUALITY_MEDIUM
+	static constexpr int _PP_HALF_EXP = SINC_WIDTH_EXP > 1 ? SINC_WIDTH_EXP - 1 : SINC_WIDTH_EXP;
+	Q* _pp_sinc[2][Tables<Q>::RESAMPLING_SINC_COUNT];
+
+	int _pp_quality = QUALITY_HIGH;
+	int _pp_prev_quality = QUALITY_HIGH;
+	int _pp_fade = 0; // frames left of the crossfade from _pp_prev_quality
+
+	static void _pp_lookup(int width_exp, Q** kernels)
+	{
+		Tables<Q>::get_instance().get_resampling_sincs(width_exp, SINC_PHASES_EXP, kernels);
+	}
+
+	// builds the tables this type needs; see Tables::freeze()
+	static void prewarm()
+	{
+		Q* t[Tables<Q>::RESAMPLING_SINC_COUNT];
+		_pp_lookup(SINC_WIDTH_EXP, t);
+		_pp_lookup(_PP_HALF_EXP, t);
+	}
 
 	PolyphaseSmplr()
 	{
-		Tables<Q>& tables = Tables<Q>::get_instance();
-		_pp_kaiser_sinc = tables.get_phased_sinc(9.6377, 0.97, SINC_WIDTH_EXP, SINC_PHASES_EXP);
-		_pp_down2x = tables.get_phased_sinc(2.7625, 0.425, SINC_WIDTH_EXP, SINC_PHASES_EXP);
-		_pp_down1_333x = tables.get_phased_sinc(8.5, 0.5, SINC_WIDTH_EXP, SINC_PHASES_EXP);
+		_pp_lookup(SINC_WIDTH_EXP, _pp_sinc[0]);
+		_pp_lookup(_PP_HALF_EXP, _pp_sinc[1]);
 	}
 
-	inline Q* _pp_get_sinc_table()
+	/*
+	QUALITY_MEDIUM halves the kernel width, QUALITY_LOW interpolates
+	linearly (and doesn't band-limit when pitching up). a change is
+	crossfaded over QUALITY_XFADE frames, computing both on the way
+	*/
+	void set_quality(int level)
+	{
+		if (level == _pp_quality) return;
+		_pp_prev_quality = _pp_quality;
+		_pp_quality = level;
+		_pp_fade = QUALITY_XFADE;
+	}
+
+	inline Q* _pp_get_sinc_table(int half)
 	{
 		int d = abs(this->inc_fx >> (this->FRAC_EXP - 4));
 		if (d > 0x18) {
-			return _pp_down2x;
+			return _pp_sinc[half][Tables<Q>::RESAMPLING_SINC_DOWN2X];
 		} else if(d > 0x12) {
-			return _pp_down1_333x;
+			return _pp_sinc[half][Tables<Q>::RESAMPLING_SINC_DOWN1_333X];
+		} else {
+			return _pp_sinc[half][Tables<Q>::RESAMPLING_SINC_UNITY];
+		}
+	}
+
+	/*
+	narrow STOREs are read through _pp_span: up to _PP_SPAN frames from
+	_pp_span_first on, widened (and scaled) in one widen_span() call, so that
+	the kernels run on floats. a window outside it refills it, from the
+	window on when playing forwards and up to it when playing backwards
+	*/
+	static constexpr bool _PP_WIDEN = !std::is_same<BUS, STORE>::value && std::is_same<Q, float>::value;
+	static constexpr int _PP_SPAN = 256;
+	BUS _pp_span[_PP_WIDEN ? _PP_SPAN : 1];
+	const Smpl<STORE>* _pp_span_smpl = nullptr;
+	int64_t _pp_span_first = 0;
+	int64_t _pp_span_end = 0;
+
+	// frames [first, first + width) as scaled BUS frames, or nullptr if they
+	// aren't all inside the sample
+	inline BUS* _pp_frames(int64_t first, int width)
+	{
+		Smpl<STORE>* smpl = this->smpl;
+		const int64_t frames = smpl->frames;
+		if (first < 0 || (first + width) > frames) return nullptr;
+		if (std::is_same<BUS, STORE>::value) return reinterpret_cast<BUS*>(&smpl->data[first]);
+		if (!_PP_WIDEN) return nullptr;
+		if (smpl != _pp_span_smpl || first < _pp_span_first || (first + width) > _pp_span_end) {
+			int64_t start = first;
+			if (this->inc_fx < 0) {
+				start = first + width - _PP_SPAN;
+				if (start < 0) start = 0;
+			}
+			int64_t end = start + _PP_SPAN;
+			if (end > frames) end = frames;
+			SmplFmt<typename STORE::T>::widen_span((float*)_pp_span, (const typename STORE::T*)&smpl->data[start], (size_t)(end - start) * BUS::CH);
+			_pp_span_smpl = smpl;
+			_pp_span_first = start;
+			_pp_span_end = end;
+		}
+		return &_pp_span[first - _pp_span_first];
+	}
+
+	template <int WIDTH_EXP>
+	inline BUS _pp_sinc_row(int64_t p, const Q* lut)
+	{
+		constexpr int WIDTH = 1 << WIDTH_EXP;
+		BUS value = BUS();
+		const int64_t first = p - (WIDTH >> 1) + 1;
+		BUS* src = _pp_frames(first, WIDTH);
+		if (src != nullptr) {
+			for (int i = 0; i < WIDTH; i++) {
+				value.accumulate(src[i].scale(lut[i]));
+			}
+		} else {
+			for (int i = 0; i < WIDTH; i++) {
+				value.accumulate(smpl_widen<BUS>((*this->smpl)[first + i]).scale(lut[i]));
+			}
+		}
+		return value;
+	}
+
+	template <int WIDTH_EXP>
+	inline BUS _pp_sinc_at(int64_t p, int half)
+	{
+		constexpr int WIDTH = 1 << WIDTH_EXP;
+		const Q* lut = _pp_get_sinc_table(half) + ((this->pos_fx >> (this->FRAC_EXP - SINC_PHASES_EXP )) & SINC_MASK) * WIDTH;
+		return _pp_sinc_row<WIDTH_EXP>(p, lut);
+	}
+
+	inline BUS _pp_linear_at(int64_t p)
+	{
+		const Q frac = (Q)(this->pos_fx & ((1 << this->FRAC_EXP) - 1)) * (Q)(1.0 / (1 << this->FRAC_EXP));
+		BUS a, b;
+		BUS* src = _pp_frames(p, 2);
+		if (src != nullptr) {
+			a = src[0];
+			b = src[1];
 		} else {
-			return _pp_kaiser_sinc;
+			a = smpl_widen<BUS>((*this->smpl)[p]);
+			b = smpl_widen<BUS>((*this->smpl)[p + 1]);
+		}
+		BUS value = a.scale(1 - frac);
+		value.accumulate(b.scale(frac));
+		return value;
+	}
+
+	inline BUS _pp_interpolate(int quality, int64_t p)
+	{
+		switch (quality) {
+			case QUALITY_HIGH: return _pp_sinc_at<SINC_WIDTH_EXP>(p, 0);
+			case QUALITY_MEDIUM: return _pp_sinc_at<_PP_HALF_EXP>(p, 1);
+			default: return _pp_linear_at(p);
 		}
 	}
 
 	BUS sample()
 	{
 		const int64_t p = this->pos();
-		if (p < POS_MIN || p > (this->smpl->frames + POS_MAX_OFFSET)) {
-			this->advance();
+		if (p < POS_MIN || p > ((int64_t)this->smpl->frames + POS_MAX_OFFSET)) {
+			if (!this->ended()) this->advance();
+			if (_pp_fade > 0) _pp_fade--;
 			return BUS();
 		}
 
-		Q* lut = _pp_get_sinc_table() + ((this->pos_fx >> (this->FRAC_EXP - SINC_PHASES_EXP )) & SINC_MASK) * SINC_WIDTH;
-
-		BUS value = BUS();
-		for (int i = 0; i < SINC_WIDTH; i++) {
-			value.accumulate( ( (*this->smpl)[p + i + OFFSET]).scale(lut[i]));
+		BUS value = _pp_interpolate(_pp_quality, p);
+		if (_pp_fade > 0) {
+			const Q t = (Q)_pp_fade * (Q)(1.0 / QUALITY_XFADE);
+			value = value.scale(1 - t);
+			value.accumulate(_pp_interpolate(_pp_prev_quality, p).scale(t));
+			_pp_fade--;
 		}
 		this->advance();
 		return value;
 	}
+
+	// the centre tap of a row of width taps, if all the others are zero
+	static Q _pp_delta_gain(const Q* row, int width)
+	{
+		const int centre = (width >> 1) - 1;
+		for (int i = 0; i < width; i++) {
+			if (i != centre && row[i] != 0) return 0;
+		}
+		return row[centre];
+	}
+
+	// whole frames at a whole increment, scaled by gain: what any kernel
+	// whose zero-phase row is a delta gives there
+	void _pp_render_copy(BUS* out, int n, Q gain)
+	{
+		Smpl<STORE>* smpl = this->smpl;
+		const int64_t p = this->pos();
+		const int64_t frames = smpl->frames;
+		const int64_t wrap = smpl->loop_start + smpl->loop_length + Smpl<STORE>::LOOP_LEAD;
+		if (std::is_same<BUS, STORE>::value && gain == 1 && this->inc_fx == ((int64_t)1 << this->FRAC_EXP) && p >= 0 && (p + n) <= frames && (smpl->loop_length == 0 || (p + n) < wrap)) {
+			memcpy(out, &smpl->data[p], sizeof(BUS) * n);
+			this->pos_fx += this->inc_fx * n;
+			return;
+		}
+		for (int i = 0; i < n; i++) {
+			const int64_t q = this->pos();
+			out[i] = (q >= 0 && q < frames) ? smpl_widen<BUS>(smpl->data[q]).scale(gain) : BUS();
+			// sample() doesn't move an ended sampler once it's out of reach
+			if ((q >= POS_MIN && q <= (frames + POS_MAX_OFFSET)) || !this->ended()) this->advance();
+		}
+	}
+
+	// whole frames at a whole increment through the sinc kernel: every frame
+	// takes the same (zero-phase) row, so that's looked up once
+	template <int WIDTH_EXP>
+	void _pp_render_whole(BUS* out, int n, int half)
+	{
+		const Q* row = _pp_get_sinc_table(half);
+		const Q gain = _pp_delta_gain(row, 1 << WIDTH_EXP);
+		if (gain != 0) {
+			_pp_render_copy(out, n, gain);
+			return;
+		}
+		const int64_t frames = this->smpl->frames;
+		for (int i = 0; i < n; i++) {
+			const int64_t p = this->pos();
+			if (p < POS_MIN || p > (frames + POS_MAX_OFFSET)) {
+				out[i] = BUS();
+				if (!this->ended()) this->advance();
+			} else {
+				out[i] = _pp_sinc_row<WIDTH_EXP>(p, row);
+				this->advance();
+			}
+		}
+	}
+
+	/*
+	renders n frames into out, as n calls to sample() would. when the
+	increment is a whole number of frames and there is no fractional phase,
+	every frame takes the kernel's zero-phase row, so the table and phase
+	lookups are done once per block. where that row is a delta (always for
+	QUALITY_LOW) it's a strided copy with the centre tap's gain, and a
+	memcpy at unity while no loop wrap or conversion is in the way. the
+	sinc kernels' rows aren't (their off-centre taps are small, not zero),
+	so those still run the taps. the output is the same either way, so
+	there is nothing to crossfade when pitch modulation resumes; the phase
+	stays whole until set_hz()/set_pos() introduce a fraction again. a
+	pending quality crossfade goes through sample(), frame by frame.
+	*/
+	void render(BUS* out, int n)
+	{
+		const int64_t frac_mask = ((int64_t)1 << this->FRAC_EXP) - 1;
+		const int64_t inc_fx = this->inc_fx;
+
+		if (this->sleeping()) {
+			memset(out, 0, sizeof(BUS) * n);
+			return;
+		}
+
+		if (_pp_fade == 0 && inc_fx > 0 && (inc_fx & frac_mask) == 0 && (this->pos_fx & frac_mask) == 0) {
+			switch (_pp_quality) {
+				case QUALITY_HIGH: _pp_render_whole<SINC_WIDTH_EXP>(out, n, 0); break;
+				case QUALITY_MEDIUM: _pp_render_whole<_PP_HALF_EXP>(out, n, 1); break;
+				default: _pp_render_copy(out, n, 1); break;
+			}
+			return;
+		}
+
+		for (int i = 0; i < n; i++) {
+			out[i] = sample();
+		}
+	}
 };
 
 
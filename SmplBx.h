@@ -4,16 +4,36 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <string>
+#include <type_traits>
 
+#include "Dsp.h"
+#include "Math.h"
 #include "Slice.h"
+#include "Smpl.h"
 #include "assert.h"
 
 
+// loop points as found in the source; start/end are inclusive frame indices
+struct SmplBx_Loop {
+	enum {
+		NONE,
+		FORWARD,
+		PINGPONG,
+		BACKWARD
+	} mode = NONE;
+	uint64_t start = 0;
+	uint64_t end = 0;
+};
+
+
 struct SmplBx_Loader {
 	const char* path;
 	int fd = -1;
@@ -36,6 +56,13 @@ struct SmplBx_Loader {
 			uint32_t byte_rate;
 			uint16_t block_align;
 			uint16_t bits_per_sample;
+			bool has_smpl;
+			uint32_t midi_unity_note;
+			uint32_t midi_pitch_fraction;
+			uint32_t num_loops;
+			uint32_t loop_type;
+			uint32_t loop_start;
+			uint32_t loop_end;
 		} wav;
 	};
 
@@ -90,6 +117,39 @@ struct SmplBx_Loader {
 		wav.data = body;
 	}
 
+	bool chkfmt_wav_smpl(Slice body)
+	{
+		if (body.size < 36) {
+			error = "short 'smpl' chunk in WAVE";
+			return false;
+		}
+
+		body.shiftLE<uint32_t>(); // manufacturer
+		body.shiftLE<uint32_t>(); // product
+		body.shiftLE<uint32_t>(); // sample period
+		wav.midi_unity_note = body.shiftLE<uint32_t>();
+		wav.midi_pitch_fraction = body.shiftLE<uint32_t>();
+		body.shiftLE<uint32_t>(); // SMPTE format
+		body.shiftLE<uint32_t>(); // SMPTE offset
+		wav.num_loops = body.shiftLE<uint32_t>();
+		body.shiftLE<uint32_t>(); // sampler data
+
+		// only the first loop is used
+		if (wav.num_loops > 0) {
+			if (body.size < 24) {
+				error = "short 'smpl' loop in WAVE";
+				return false;
+			}
+			body.shiftLE<uint32_t>(); // cue point id
+			wav.loop_type = body.shiftLE<uint32_t>();
+			wav.loop_start = body.shiftLE<uint32_t>();
+			wav.loop_end = body.shiftLE<uint32_t>();
+		}
+
+		wav.has_smpl = true;
+		return true;
+	}
+
 	bool chkfmt_wav()
 	{
 		uint32_t tsz = slice.at(4).trim(4).asLE<uint32_t>();
@@ -100,6 +160,7 @@ struct SmplBx_Loader {
 
 		bool got_fmt = false;
 		bool got_data = false;
+		wav.has_smpl = false;
 
 		Slice chunks = slice.at(8 + 4).trim(tsz - 4);
 		while (chunks.size > 0) {
@@ -113,9 +174,13 @@ struct SmplBx_Loader {
 			} else if(magic.matches_string("data")) {
 				got_data = true;
 				chkfmt_wav_data(body);
+			} else if(magic.matches_string("smpl")) {
+				if (!chkfmt_wav_smpl(body)) return false;
 			}
 
-			chunks = chunks.at(8 + sz);
+			// chunks are padded to an even size
+			size_t next = 8 + sz + (sz & 1);
+			chunks = chunks.at(next < chunks.size ? next : chunks.size);
 		}
 
 		if (!got_fmt) {
@@ -158,10 +223,12 @@ struct SmplBx_Loader {
 
 	bool chkfmt()
 	{
-		mapptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 		if (mapptr == MAP_FAILED) {
-			error = strerror(errno);
-			return false;
+			mapptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapptr == MAP_FAILED) {
+				error = strerror(errno);
+				return false;
+			}
 		}
 
 		slice = Slice(mapptr, st.st_size);
@@ -203,26 +270,60 @@ struct SmplBx_Loader {
 	float get_base()
 	{
 		switch (fmt) {
-			case WAVE: return 440;
+			case WAVE:
+				if (wav.has_smpl) {
+					double note = (double)wav.midi_unity_note + (double)wav.midi_pitch_fraction / 4294967296.0;
+					return 440.0 * pow(2.0, (note - 69.0) / 12.0);
+				}
+				return 440;
 			default: arghf("no fmt!");
 		}
 	}
 
+	SmplBx_Loop get_loop()
+	{
+		SmplBx_Loop loop;
+		switch (fmt) {
+			case WAVE:
+				if (!wav.has_smpl || wav.num_loops == 0) break;
+				if (wav.loop_end < wav.loop_start || wav.loop_end >= get_num_frames()) break;
+				switch (wav.loop_type) {
+					case 0: loop.mode = SmplBx_Loop::FORWARD; break;
+					case 1: loop.mode = SmplBx_Loop::PINGPONG; break;
+					case 2: loop.mode = SmplBx_Loop::BACKWARD; break;
+					default: break;
+				}
+				loop.start = wav.loop_start;
+				loop.end = wav.loop_end;
+				break;
+			default: arghf("no fmt!");
+		}
+		return loop;
+	}
+
 	template <typename BUS>
 	void populate_wav(BUS* data)
 	{
+		typedef SmplFmt<typename BUS::T> FMT;
+		if (wav.bits_per_sample == 16 && std::is_same<typename BUS::T, float>::value && sizeof(BUS) == sizeof(float) * BUS::CH) {
+			// the common case is one flat conversion (little endian host)
+			dsp_get_kernels()->s16_to_f32((float*)data, (const int16_t*)wav.data.data, (size_t)get_num_frames() * BUS::CH);
+			return;
+		}
 		for (int i = 0; i < get_num_frames(); i++) {
 			BUS value;
+			Slice frame = wav.data.at(i * wav.block_align);
 			for (int j = 0; j < get_num_channels(); j++) {
-				typename BUS::T v = 0;
+				float v = 0;
 				if (wav.bits_per_sample == 16) {
-					int16_t iv = wav.data.at(i * 4 + j * 2).trim(2).asLE<int16_t>();
-					v = ((decltype(v)) iv) / (decltype(v))32768.0;
+					int16_t iv = frame.at(j * 2).trim(2).asLE<int16_t>();
+					v = (float)iv / 32768.0f;
 				} else if(wav.bits_per_sample == 8) {
-					int8_t iv = wav.data.at(i * 2 + j).trim(1).asLE<int8_t>();
-					v = ((decltype(v)) iv) / (decltype(v))128.0;
+					// 8-bit WAVE is unsigned
+					uint8_t iv = frame.at(j).trim(1).asLE<uint8_t>();
+					v = (float)((int)iv - 128) / 128.0f;
 				}
-				value[j] = v;
+				value[j] = FMT::from_float(v);
 			}
 			data[i] = value;
 		}
@@ -258,10 +359,260 @@ struct SmplBxTypeId<double> {
 	static constexpr const char* value = "f64";
 };
 
+template <>
+struct SmplBxTypeId<int16_t> {
+	static constexpr const char* value = "s16";
+};
+
+template <>
+struct SmplBxTypeId<f16> {
+	static constexpr const char* value = "f16";
+};
+
+
+static inline uint64_t smplbx_hash(Slice slice)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < slice.size; i++) {
+		h ^= (uint8_t)slice.data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+/*
+loops are unrolled into the cache so that playback only ever has to wrap
+forward (see Smpl). the loop body is the frames the loop cycles through:
+start..end for forward loops, start..end..start+1 for ping-pong loops and
+end-1..start,end for backward loops (which play through to end once, so
+like ping-pong they turn around without repeating it). short bodies are
+repeated until the loop is at least LOOP_GUARD frames long, and LOOP_GUARD
+frames of the cycle are appended as a guard, so the interpolation kernel
+never has to wrap. frames past the loop
+are dropped; a looping voice never gets there.
+*/
+struct SmplBx_LoopLayout {
+	uint64_t loop_start;
+	uint64_t body_length;
+	uint64_t loop_length;
+	uint64_t frames;
+
+	static SmplBx_LoopLayout calc(uint64_t linear_frames, SmplBx_Loop loop)
+	{
+		SmplBx_LoopLayout l;
+		uint64_t length = loop.end - loop.start + 1;
+		switch (loop.mode) {
+			case SmplBx_Loop::NONE:
+				l.loop_start = 0;
+				l.body_length = 0;
+				l.loop_length = 0;
+				l.frames = linear_frames;
+				return l;
+			case SmplBx_Loop::FORWARD:
+				l.loop_start = loop.start;
+				l.body_length = length;
+				break;
+			case SmplBx_Loop::PINGPONG:
+				l.loop_start = loop.start;
+				l.body_length = length + (length > 2 ? length - 2 : 0);
+				break;
+			case SmplBx_Loop::BACKWARD:
+				l.loop_start = loop.end + 1;
+				l.body_length = length;
+				break;
+		}
+		const uint64_t guard = Smpl<FloatMono>::LOOP_GUARD;
+		uint64_t reps = (guard + l.body_length - 1) / l.body_length;
+		l.loop_length = l.body_length * reps;
+		l.frames = l.loop_start + l.loop_length + guard;
+		return l;
+	}
+
+	uint64_t body_index(uint64_t i, SmplBx_Loop loop)
+	{
+		switch (loop.mode) {
+			case SmplBx_Loop::PINGPONG:
+				if (i > loop.end - loop.start) {
+					return loop.end - (i - (loop.end - loop.start));
+				}
+				return loop.start + i;
+			case SmplBx_Loop::BACKWARD:
+				if (i < loop.end - loop.start) {
+					return loop.end - 1 - i;
+				}
+				return loop.end;
+			default:
+				return loop.start + i;
+		}
+	}
+
+	template <typename BUS>
+	void unroll(BUS* dst, BUS* linear, SmplBx_Loop loop)
+	{
+		if (loop.mode == SmplBx_Loop::NONE) {
+			memcpy(dst, linear, sizeof(BUS) * frames);
+			return;
+		}
+		for (uint64_t i = 0; i < loop_start; i++) {
+			dst[i] = linear[i];
+		}
+		for (uint64_t i = 0; i < body_length; i++) {
+			dst[loop_start + i] = linear[body_index(i, loop)];
+		}
+		for (uint64_t i = body_length; i < (frames - loop_start); i++) {
+			dst[loop_start + i] = dst[loop_start + (i % body_length)];
+		}
+	}
+};
+
+
+/*
+offline sample rate conversion used when building resampled cache variants.
+it's a Kaiser windowed sinc with ZERO_CROSSINGS zero crossings on each side
+(~100dB stopband), tabulated in KERNEL_RES points per zero crossing and
+linearly interpolated. far too slow for playback, but it only runs once per
+cache build.
+*/
+struct SmplBx_Resampler {
+	static constexpr int ZERO_CROSSINGS = 32;
+	static constexpr int KERNEL_RES = 512;
+	static constexpr double BETA = 10.0;
+	static constexpr double LOWPASS_FACTOR = 0.95;
+
+	static uint64_t calc_frames(uint64_t src_frames, double src_rate, double dst_rate)
+	{
+		return (uint64_t) ceil((double)src_frames * dst_rate / src_rate);
+	}
+
+	template <typename BUS>
+	static void resample(Smpl<BUS>* dst, Smpl<BUS>* src)
+	{
+		double step = (double)src->sample_rate / (double)dst->sample_rate;
+		double fc = (step > 1.0 ? (1.0 / step) : 1.0) * LOWPASS_FACTOR;
+		double width = (double)ZERO_CROSSINGS / fc; // kernel half width in source frames
+
+		int kernel_size = ZERO_CROSSINGS * KERNEL_RES + 2;
+		double* kernel = (double*) malloc(sizeof(double) * kernel_size);
+		AN(kernel);
+		double I0_beta = bessel_I0(BETA);
+		for (int i = 0; i < kernel_size; i++) {
+			double u = (double)i / (double)(ZERO_CROSSINGS * KERNEL_RES);
+			double x = u * (double)ZERO_CROSSINGS * M_PI;
+			double A = (i == 0) ? 1.0 : (sin(x) / x);
+			double W = (u < 1.0) ? (bessel_I0(BETA * sqrt(1.0 - u*u)) / I0_beta) : 0.0;
+			kernel[i] = A * W * fc;
+		}
+
+		double kscale = (double)(ZERO_CROSSINGS * KERNEL_RES) / width;
+		for (uint64_t n = 0; n < dst->frames; n++) {
+			double x = (double)n * step;
+			int64_t i0 = (int64_t)floor(x - width) + 1;
+			int64_t i1 = (int64_t)floor(x + width);
+			BUS value = BUS();
+			for (int64_t i = i0; i <= i1; i++) {
+				double k = fabs(x - (double)i) * kscale;
+				int ki = (int)k;
+				if (ki >= kernel_size - 1) continue;
+				double kf = k - (double)ki;
+				double h = kernel[ki] + (kernel[ki + 1] - kernel[ki]) * kf;
+				value.accumulate((*src)[i].scale(h));
+			}
+			dst->data[n] = value;
+		}
+
+		free(kernel);
+	}
+};
+
+
+/*
+cache files start with a SmplBx_CacheHeader, followed by the Smpl<BUS> image
+at offset SIZE. the header records what the cache was built from (source
+size, mtime and content hash) and how it is laid out, so that a cache hit can
+be validated without touching the sample data. caches are written to a
+temporary file and renamed into place once complete, so a cache that exists
+under its final name is never half-written.
+*/
+struct SmplBx_CacheHeader {
+	static constexpr size_t SIZE = 128;
+	static constexpr uint32_t VERSION = 5;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+
+	// source identity
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint64_t src_hash;
+
+	// layout
+	char type_id[8];
+	uint32_t num_channels;
+	uint32_t frame_size;
+	uint64_t frames;
+	uint64_t smpl_size;
+	uint32_t target_rate; // 0 if stored at the source sample rate
+
+	static const char* get_magic()
+	{
+		return "SMPLBX\x1a";
+	}
+
+	template <typename BUS>
+	void init(struct stat* src_st, uint64_t hash, uint64_t num_frames, uint32_t rate)
+	{
+		memset(this, 0, sizeof(*this));
+		memcpy(magic, get_magic(), sizeof(magic));
+		version = VERSION;
+		header_size = SIZE;
+		src_size = src_st->st_size;
+		set_mtime(src_st);
+		src_hash = hash;
+		strncpy(type_id, SmplBxTypeId<typename BUS::T>::value, sizeof(type_id));
+		num_channels = BUS::CH;
+		frame_size = sizeof(BUS);
+		frames = num_frames;
+		smpl_size = Smpl<BUS>::calc_size(num_frames);
+		target_rate = rate;
+	}
+
+	void set_mtime(struct stat* src_st)
+	{
+		src_mtime_sec = src_st->st_mtim.tv_sec;
+		src_mtime_nsec = src_st->st_mtim.tv_nsec;
+	}
+
+	bool matches_mtime(struct stat* src_st)
+	{
+		return src_mtime_sec == src_st->st_mtim.tv_sec && src_mtime_nsec == src_st->st_mtim.tv_nsec;
+	}
+
+	template <typename BUS>
+	bool matches_layout(size_t file_size, uint32_t rate)
+	{
+		if (memcmp(magic, get_magic(), sizeof(magic)) != 0) return false;
+		if (version != VERSION) return false;
+		if (header_size != SIZE) return false;
+		if (strncmp(type_id, SmplBxTypeId<typename BUS::T>::value, sizeof(type_id)) != 0) return false;
+		if (num_channels != BUS::CH) return false;
+		if (frame_size != sizeof(BUS)) return false;
+		if (frames == 0 || smpl_size != Smpl<BUS>::calc_size(frames)) return false;
+		if (file_size != SIZE + smpl_size) return false;
+		if (target_rate != rate) return false;
+		return true;
+	}
+};
+
+static_assert(sizeof(SmplBx_CacheHeader) <= SmplBx_CacheHeader::SIZE, "SmplBx_CacheHeader does not fit");
+
 
 struct SmplBx {
 	template <typename BUS>
-	std::string get_cache_path(const char* path)
+	std::string get_cache_path(const char* path, uint32_t target_rate = 0)
 	{
 		std::string p(path);
 
@@ -281,59 +632,188 @@ struct SmplBx {
 		snprintf(buf, sizeof(buf), ".ch%d%s", BUS::CH, SmplBxTypeId<typename BUS::T>::value);
 		p += std::string(buf);
 
+		if (target_rate > 0) {
+			snprintf(buf, sizeof(buf), ".r%u", target_rate);
+			p += std::string(buf);
+		}
+
 		return p;
 	}
 
 	template <typename BUS>
-	Smpl<BUS>* load(const char* path)
+	static SmplBx_CacheHeader* get_header(Smpl<BUS>* smpl)
 	{
-		SmplBx_Loader ldr(path);
-		if (!ldr.open()) arghf("could not open %s: %s", path, strerror(errno));
-
-		std::string cache_path = get_cache_path<BUS>(path);
+		return (SmplBx_CacheHeader*) ((char*)smpl - SmplBx_CacheHeader::SIZE);
+	}
 
+	// returns the cached sample if the cache at cache_path is valid for the
+	// source opened by ldr, or nullptr if it must be (re)built
+	template <typename BUS>
+	Smpl<BUS>* load_cache(SmplBx_Loader& ldr, const std::string& cache_path, uint32_t target_rate)
+	{
 		int fd = open(cache_path.c_str(), O_RDWR);
-		bool do_populate = false;
-		uint64_t frames = 0;
 		if (fd == -1) {
 			if (errno != ENOENT) {
-				arghf("%s: %s", path, strerror(errno));
-			}
-
-			if (!ldr.chkfmt()) arghf("%s in %s", ldr.error.c_str(), path);
-			if (ldr.get_num_channels() != BUS::CH) arghf("expected %d channel(s) but found %d in %s", BUS::CH, ldr.get_num_channels(), path);
-
-			fd = open(cache_path.c_str(), O_CREAT | O_RDWR, 0777);
-			if (fd == -1) {
 				arghf("%s: %s", cache_path.c_str(), strerror(errno));
 			}
-			frames = ldr.get_num_frames();
-			size_t sz = Smpl<BUS>::calc_size(frames);
-			if (ftruncate(fd, sz) == -1) {
-				arghf("%s: %s", cache_path.c_str(), strerror(errno));
-			}
-
-			do_populate = true;
+			return nullptr;
 		}
 
 		struct stat st;
 		if (fstat(fd, &st) == -1) {
-			arghf("fstat: %s: %s", path, strerror(errno));
+			arghf("fstat: %s: %s", cache_path.c_str(), strerror(errno));
+		}
+
+		if (st.st_size < (off_t)SmplBx_CacheHeader::SIZE) {
+			AZ(close(fd));
+			return nullptr;
 		}
 
 		void* ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 		if (ptr == MAP_FAILED) {
 			arghf("mmap: %s: %s", cache_path.c_str(), strerror(errno));
 		}
+		AZ(close(fd));
+
+		auto* hdr = (SmplBx_CacheHeader*) ptr;
+		auto* smpl = (Smpl<BUS>*) ((char*)ptr + SmplBx_CacheHeader::SIZE);
+
+		bool valid =
+			hdr->matches_layout<BUS>(st.st_size, target_rate)
+			&& smpl->frames == hdr->frames
+			&& hdr->src_size == (uint64_t)ldr.st.st_size;
+
+		if (valid && !hdr->matches_mtime(&ldr.st)) {
+			// source was touched; if the content is unchanged the cache
+			// is refreshed in place instead of rebuilt
+			if (ldr.chkfmt() && smplbx_hash(ldr.slice) == hdr->src_hash) {
+				hdr->set_mtime(&ldr.st);
+			} else {
+				valid = false;
+			}
+		}
 
-		auto* smpl = (Smpl<BUS>*) ptr;
-		if (do_populate) {
-			smpl->frames = frames;
-			smpl->sample_rate = ldr.get_sample_rate();
-			smpl->base = ldr.get_base();
+		if (!valid) {
+			AZ(munmap(ptr, st.st_size));
+			return nullptr;
+		}
+
+		return smpl;
+	}
+
+	template <typename BUS>
+	Smpl<BUS>* build_cache(SmplBx_Loader& ldr, const std::string& cache_path, uint32_t target_rate)
+	{
+		const char* path = ldr.path;
+		if (!ldr.chkfmt()) arghf("%s in %s", ldr.error.c_str(), path);
+		if (ldr.get_num_channels() != BUS::CH) arghf("expected %d channel(s) but found %d in %s", BUS::CH, ldr.get_num_channels(), path);
+
+		char buf[64];
+		snprintf(buf, sizeof(buf), ".tmp%d", (int)getpid());
+		std::string tmp_path = cache_path + std::string(buf);
+
+		int fd = open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (fd == -1) {
+			arghf("%s: %s", tmp_path.c_str(), strerror(errno));
+		}
+
+		uint64_t linear_frames = ldr.get_num_frames();
+		SmplBx_Loop loop = ldr.get_loop();
+		if (target_rate > 0) {
+			double ratio = (double)target_rate / (double)ldr.get_sample_rate();
+			linear_frames = SmplBx_Resampler::calc_frames(linear_frames, ldr.get_sample_rate(), target_rate);
+			if (loop.mode != SmplBx_Loop::NONE) {
+				loop.start = (uint64_t)llround((double)loop.start * ratio);
+				loop.end = (uint64_t)llround((double)(loop.end + 1) * ratio) - 1;
+				if (loop.end >= linear_frames) loop.end = linear_frames - 1;
+				if (loop.start > loop.end) loop.start = loop.end;
+			}
+		}
+		SmplBx_LoopLayout layout = SmplBx_LoopLayout::calc(linear_frames, loop);
+		uint64_t frames = layout.frames;
+		size_t sz = SmplBx_CacheHeader::SIZE + Smpl<BUS>::calc_size(frames);
+		if (ftruncate(fd, sz) == -1) {
+			arghf("%s: %s", tmp_path.c_str(), strerror(errno));
+		}
+
+		void* ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			arghf("mmap: %s: %s", tmp_path.c_str(), strerror(errno));
+		}
+		AZ(close(fd));
+
+		auto* smpl = (Smpl<BUS>*) ((char*)ptr + SmplBx_CacheHeader::SIZE);
+		smpl->frames = frames;
+		smpl->sample_rate = target_rate > 0 ? target_rate : ldr.get_sample_rate();
+		smpl->base = ldr.get_base();
+		smpl->loop_start = layout.loop_start;
+		smpl->loop_length = layout.loop_length;
+
+		if (target_rate == 0 && loop.mode == SmplBx_Loop::NONE) {
 			ldr.populate<BUS>(smpl->data);
+		} else {
+			// decode (and resample) into a linear buffer first, then lay
+			// that out with the loop unrolled
+			Smpl<BUS>* linear = Smpl<BUS>::alloc(linear_frames);
+			if (target_rate > 0) {
+				// resampling happens in float regardless of storage format
+				typedef Bus<float, BUS::CH> FBUS;
+				Smpl<FBUS>* src = Smpl<FBUS>::alloc(ldr.get_num_frames());
+				Smpl<FBUS>* dst = Smpl<FBUS>::alloc(linear_frames);
+				src->sample_rate = ldr.get_sample_rate();
+				dst->sample_rate = target_rate;
+				ldr.populate<FBUS>(src->data);
+				SmplBx_Resampler::resample(dst, src);
+				for (uint64_t i = 0; i < linear_frames; i++) {
+					linear->data[i] = smpl_narrow<BUS>(dst->data[i]);
+				}
+				free(src);
+				free(dst);
+			} else {
+				ldr.populate<BUS>(linear->data);
+			}
+			layout.unroll(smpl->data, linear->data, loop);
+			free(linear);
+		}
+
+		// header goes in last; until then the magic is all zeroes. the data
+		// is synced before the header is written, and the header before the
+		// rename, so that after a crash a valid header means valid data
+		if (msync(ptr, sz, MS_SYNC) == -1) {
+			arghf("msync: %s: %s", tmp_path.c_str(), strerror(errno));
+		}
+		auto* hdr = (SmplBx_CacheHeader*) ptr;
+		hdr->init<BUS>(&ldr.st, smplbx_hash(ldr.slice), frames, target_rate);
+		if (msync(ptr, SmplBx_CacheHeader::SIZE, MS_SYNC) == -1) {
+			arghf("msync: %s: %s", tmp_path.c_str(), strerror(errno));
 		}
 
+		if (rename(tmp_path.c_str(), cache_path.c_str()) == -1) {
+			int e = errno;
+			unlink(tmp_path.c_str());
+			arghf("rename %s: %s", cache_path.c_str(), strerror(e));
+		}
+
+		return smpl;
+	}
+
+	/*
+	loads path through its cache. if target_rate is non-zero the cache holds
+	a variant resampled to target_rate at build time; playing it back on a
+	device running at target_rate gives a unity increment at the root pitch.
+	*/
+	template <typename BUS>
+	Smpl<BUS>* load(const char* path, uint32_t target_rate = 0)
+	{
+		SmplBx_Loader ldr(path);
+		if (!ldr.open()) arghf("could not open %s: %s", path, strerror(errno));
+
+		std::string cache_path = get_cache_path<BUS>(path, target_rate);
+
+		Smpl<BUS>* smpl = load_cache<BUS>(ldr, cache_path, target_rate);
+		if (smpl == nullptr) {
+			smpl = build_cache<BUS>(ldr, cache_path, target_rate);
+		}
 		return smpl;
 	}
 
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Bus.h"
+#include "BusBuffer.h"
+#include "Smpl.h"
+#include "Trace.h"
+#include "assert.h"
+
+/*
+polyphonic sampler: VOICES voices of SMPLR sharing one Smpl. voices come
+from a fixed pool (note_on() steals the oldest voice when all are busy), and
+are rendered a block at a time, in order of their position in the sample, so
+voices reading the same region of a long sample do so back to back while it's
+still in cache. gain changes (including note_off()) are ramped linearly over
+one block to avoid zipper noise and clicks; a stolen voice fades out over a
+block too, in one of VOICES spare slots, while the new note starts in another.
+
+note_on() returns a Handle (slot and serial) for set_hz()/set_gain()/
+note_off(); once its voice is stolen or retired the serial no longer
+matches, and calls with it do nothing.
+
+there's no oversampling here; PolyphaseSmplr band-limits on its own up to an
+octave or so above the root, which is what this is meant for.
+*/
+template <typename BUS, int VOICES, typename SMPLR = PolyphaseSmplr<BUS>, int BLOCK = 256>
+struct SmplPoly {
+	typedef BUS T;
+	typedef typename BUS::T Q;
+	typedef typename SMPLR::SMPL SMPL;
+
+	// VOICES playing, plus as many fading out after being stolen
+	static constexpr int SLOTS = 2 * VOICES;
+
+	struct Voice {
+		SMPLR smplr;
+		Q gain;
+		Q target_gain;
+		bool active;
+		bool stolen;
+		uint64_t serial;
+	};
+
+	struct Handle {
+		int slot = -1;
+		uint64_t serial = 0;
+	};
+
+	SMPL* smpl = nullptr;
+	float sample_rate;
+	Voice voices[SLOTS];
+	int order[SLOTS];
+	int n_active = 0; // voices in order[], stolen ones included
+	int n_playing = 0;
+	uint64_t serial = 0;
+	BUS scratch[BLOCK];
+
+	// builds the tables the voices need; see Tables::freeze()
+	static void prewarm()
+	{
+		SMPLR::prewarm();
+	}
+
+	SmplPoly()
+	{
+		for (auto& v : voices) {
+			v.active = false;
+			v.stolen = false;
+		}
+	}
+
+	void set_sample_rate(float value)
+	{
+		sample_rate = value;
+		for (auto& v : voices) {
+			v.smplr.set_sample_rate(value);
+		}
+	}
+
+	void set_quality(int level)
+	{
+		for (auto& v : voices) {
+			v.smplr.set_quality(level);
+		}
+	}
+
+	void set_smpl(SMPL* value)
+	{
+		smpl = value;
+		for (auto& v : voices) {
+			v.smplr.smpl = value;
+		}
+	}
+
+	int _oldest(bool stolen)
+	{
+		int oldest = -1;
+		for (int k = 0; k < n_active; k++) {
+			const int i = order[k];
+			if (voices[i].stolen == stolen && (oldest < 0 || voices[i].serial < voices[oldest].serial)) {
+				oldest = i;
+			}
+		}
+		return oldest;
+	}
+
+	int _alloc_voice()
+	{
+		if (n_playing == VOICES) {
+			// steal the oldest; it fades out over the next block
+			Voice& v = voices[_oldest(false)];
+			v.stolen = true;
+			v.target_gain = Q();
+			n_playing--;
+		}
+		n_playing++;
+
+		if (n_active < SLOTS) {
+			for (int i = 0; i < SLOTS; i++) {
+				if (!voices[i].active) {
+					order[n_active++] = i;
+					return i;
+				}
+			}
+		}
+
+		// more than VOICES steals since the last render: cut the oldest
+		// stolen voice instead
+		int i = _oldest(true);
+		voices[i].stolen = false;
+		return i;
+	}
+
+	Voice* _voice(Handle h)
+	{
+		if (h.slot < 0 || h.slot >= SLOTS) return nullptr;
+		Voice& v = voices[h.slot];
+		return (v.active && !v.stolen && v.serial == h.serial) ? &v : nullptr;
+	}
+
+	Handle note_on(float hz, Q gain, float pos = 0.0f)
+	{
+		ASSERT(smpl != nullptr);
+		int i = _alloc_voice();
+		Voice& v = voices[i];
+		v.smplr.set_pos(pos);
+		v.smplr.set_hz(hz);
+		v.gain = v.active ? Q() : gain; // cut voices fade in from silence
+		v.target_gain = gain;
+		v.active = true;
+		v.serial = serial++;
+		Handle h;
+		h.slot = i;
+		h.serial = v.serial;
+		return h;
+	}
+
+	void note_off(Handle h)
+	{
+		Voice* v = _voice(h);
+		if (v != nullptr) v->target_gain = Q();
+	}
+
+	void set_hz(Handle h, float hz)
+	{
+		Voice* v = _voice(h);
+		if (v != nullptr) v->smplr.set_hz(hz);
+	}
+
+	void set_gain(Handle h, Q gain)
+	{
+		Voice* v = _voice(h);
+		if (v != nullptr) v->target_gain = gain;
+	}
+
+	void _sort()
+	{
+		// insertion sort; the order barely changes from block to block
+		for (int k = 1; k < n_active; k++) {
+			int i = order[k];
+			int64_t p = voices[i].smplr.pos_fx;
+			int j = k - 1;
+			while (j >= 0 && voices[order[j]].smplr.pos_fx > p) {
+				order[j + 1] = order[j];
+				j--;
+			}
+			order[j + 1] = i;
+		}
+	}
+
+	void _mix(Voice& v, BUS* out, int n)
+	{
+		bus_mix_ramp(out, scratch, v.gain, (v.target_gain - v.gain) / (Q)n, n);
+		v.gain = v.target_gain;
+	}
+
+	void render(BUS* out, int n)
+	{
+		memset(out, 0, sizeof(BUS) * n);
+		_sort();
+		for (int offset = 0; offset < n; offset += BLOCK) {
+			int m = (n - offset) < BLOCK ? (n - offset) : BLOCK;
+			for (int k = 0; k < n_active; k++) {
+				Voice& v = voices[order[k]];
+				TRACE_SCOPE("voice");
+				v.smplr.render(scratch, m);
+				_mix(v, out + offset, m);
+			}
+
+			// retire voices that ended or faded out
+			int k1 = 0;
+			for (int k = 0; k < n_active; k++) {
+				Voice& v = voices[order[k]];
+				if (v.smplr.ended() || (v.gain == Q() && v.target_gain == Q())) {
+					if (!v.stolen) n_playing--;
+					v.active = false;
+					v.stolen = false;
+				} else {
+					order[k1++] = order[k];
+				}
+			}
+			n_active = k1;
+		}
+	}
+};
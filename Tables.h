@@ -1,12 +1,105 @@
 #pragma once
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <tuple>
+#include <limits>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "Math.h"
+#include "assert.h"
 
+/*
+tables are persisted to an on-disk cache (see default_cache_dir()), one file
+per key, so that only the first run ever computes them; later runs mmap()
+them, which costs no math and shares the pages between processes. files are
+named after the key (doubles in %a notation, so they round-trip exactly;
+window functions by a hash of their values, since pointers don't survive a
+restart) and are written to a temporary file and renamed into place, like
+SmplBx caches. a cache that can't be read or written is not an error; the
+table is just computed.
 
+names also carry a version per generator (the *_GEN constants in Tables),
+since nothing else tells a stale table from a good one: bump it whenever a
+mk_*() changes its output. VERSION covers the file layout only.
+*/
+struct TablesCache_Header {
+	static constexpr size_t SIZE = 64; // the table follows, cache line aligned
+	static constexpr uint32_t VERSION = 1;
+
+	char magic[8];
+	uint32_t version;
+	uint32_t elem_size;
+	uint32_t elem_is_integer;
+	uint32_t count;
+
+	static const char* get_magic()
+	{
+		return "TABLES\x1a";
+	}
+
+	template <typename T>
+	void init(uint32_t n)
+	{
+		memset(this, 0, sizeof(*this));
+		memcpy(magic, get_magic(), sizeof(magic));
+		version = VERSION;
+		elem_size = sizeof(T);
+		elem_is_integer = std::numeric_limits<T>::is_integer;
+		count = n;
+	}
+
+	template <typename T>
+	bool matches(uint32_t n, size_t file_size)
+	{
+		if (memcmp(magic, get_magic(), sizeof(magic)) != 0) return false;
+		if (version != VERSION) return false;
+		if (elem_size != sizeof(T)) return false;
+		if (elem_is_integer != (uint32_t)std::numeric_limits<T>::is_integer) return false;
+		if (count != n) return false;
+		if (file_size != SIZE + sizeof(T) * n) return false;
+		return true;
+	}
+};
+
+static inline uint64_t tables_hash_window_fn(double (*window_fn)(double))
+{
+	// FNV-1a over the function's values
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i <= 16; i++) {
+		double v = window_fn((double)i / 16.0);
+		uint64_t bits;
+		memcpy(&bits, &v, sizeof(bits));
+		for (int j = 0; j < 8; j++) {
+			h ^= (bits >> (j * 8)) & 0xff;
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h;
+}
+
+static_assert(sizeof(TablesCache_Header) <= TablesCache_Header::SIZE, "TablesCache_Header does not fit");
+
+/*
+Tables<T>::get_instance() may be used from any thread: lookups and builds are
+serialized by a mutex. tables are never freed or moved, so a table pointer
+taken once (components do so in their constructors) can be used lock-free
+forever after. freeze() ends the build phase; from then on lookups take no
+lock at all, and a lookup of a table that was not built before is an error,
+which keeps table construction off the audio thread. build what's needed
+first with the components' static prewarm() (or by constructing them).
+
+tables are 64-byte aligned.
+*/
 template <typename T>
 struct Tables {
 	static Tables<T>& get_instance()
@@ -15,10 +108,128 @@ struct Tables {
 		return instance;
 	}
 
+	// cache files are <cache_dir>/<key>; the directory is made on the first
+	// save, and empty disables the cache
+	std::string cache_dir = default_cache_dir();
+
+	// $TABLES_CACHE if set (empty disables the cache), else cache4tables in
+	// $XDG_CACHE_HOME or ~/.cache, so that every program shares one cache no
+	// matter where it's run from
+	static std::string default_cache_dir()
+	{
+		const char* env = getenv("TABLES_CACHE");
+		if (env != nullptr) return std::string(env);
+		env = getenv("XDG_CACHE_HOME");
+		if (env != nullptr && env[0] != '\0') return std::string(env) + "/cache4tables";
+		env = getenv("HOME");
+		if (env != nullptr && env[0] != '\0') return std::string(env) + "/.cache/cache4tables";
+		return std::string();
+	}
+
+	// generator versions, part of the cache keys
+	static constexpr int FIR_GEN = 1;
+	static constexpr int SINC_GEN = 1;
+	static constexpr int GRAIN_GEN = 1;
+
+	std::mutex mutex;
+	std::atomic<bool> frozen{false};
+
 	Tables() {}
 	Tables(Tables<T> const&);
 	void operator=(Tables<T> const&);
 
+	void freeze()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		frozen.store(true, std::memory_order_release);
+	}
+
+	static T* alloc(size_t count)
+	{
+		size_t sz = (sizeof(T) * count + 63) & ~(size_t)63;
+		T* tbl = (T*) aligned_alloc(64, sz);
+		AN(tbl);
+		return tbl;
+	}
+
+	template <typename KEY, typename MK>
+	T* _lookup(std::map<KEY, T*>& map, const KEY& key, MK mk)
+	{
+		if (frozen.load(std::memory_order_acquire)) {
+			auto it = map.find(key);
+			if (it == map.end()) arghf("table lookup after Tables::freeze() missed; prewarm it\n");
+			return it->second;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = map.find(key);
+		if (it != map.end()) return it->second;
+		// freeze() may have come in while this waited for the lock
+		if (frozen.load(std::memory_order_relaxed)) arghf("table lookup after Tables::freeze() missed; prewarm it\n");
+		T* tbl = mk();
+		map[key] = tbl;
+		return tbl;
+	}
+
+	std::string get_cache_path(const char* key)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), ".%c%d", std::numeric_limits<T>::is_integer ? 'i' : 'f', (int)sizeof(T));
+		return cache_dir + "/" + std::string(key) + std::string(buf);
+	}
+
+	T* load_cache(const std::string& path, uint32_t count)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd == -1) return nullptr;
+		struct stat st;
+		void* ptr = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size > TablesCache_Header::SIZE) {
+			ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (ptr == MAP_FAILED) return nullptr;
+		if (!((TablesCache_Header*)ptr)->matches<T>(count, st.st_size)) {
+			munmap(ptr, st.st_size);
+			return nullptr;
+		}
+		return (T*) ((char*)ptr + TablesCache_Header::SIZE);
+	}
+
+	void save_cache(const std::string& path, const T* tbl, uint32_t count)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), ".tmp%d", (int)getpid());
+		std::string tmp_path = path + std::string(buf);
+		// mkdir -p the cache directory; failures show up as fopen() failing
+		for (size_t i = 1; i <= cache_dir.length(); i++) {
+			if (i == cache_dir.length() || cache_dir[i] == '/') {
+				mkdir(cache_dir.substr(0, i).c_str(), 0755);
+			}
+		}
+		FILE* f = fopen(tmp_path.c_str(), "wb");
+		if (f == NULL) return;
+		char hdr[TablesCache_Header::SIZE] = {0};
+		((TablesCache_Header*)hdr)->init<T>(count);
+		bool ok = fwrite(hdr, sizeof(hdr), 1, f) == 1 && fwrite(tbl, sizeof(T), count, f) == count;
+		ok = (fclose(f) == 0) && ok;
+		if (!ok || rename(tmp_path.c_str(), path.c_str()) == -1) {
+			unlink(tmp_path.c_str());
+		}
+	}
+
+	template <typename MK>
+	T* get_cached(const char* key, uint32_t count, MK mk)
+	{
+		if (cache_dir.empty()) return mk();
+		std::string path = get_cache_path(key);
+		T* tbl = load_cache(path, count);
+		if (tbl == nullptr) {
+			tbl = mk();
+			save_cache(path, tbl, count);
+		}
+		return tbl;
+	}
+
 	// compact downsampler FIR
 
 	typedef std::tuple<int,int,double(*)(double)> CompactDownsamplerFIR_Key;
@@ -28,7 +239,7 @@ struct Tables {
 	{
 		int real_fir_size = ratio * zero_crossings;
 		int fir_size = real_fir_size - zero_crossings;
-		T* tbl = (T*) malloc(sizeof(T) * fir_size);
+		T* tbl = alloc(fir_size);
 
 		double l = 1.0;
 		int n = ratio - 1;
@@ -52,10 +263,13 @@ struct Tables {
 	T* get_compact_downsampler_fir(int ratio, int zero_crossings, double (*window_fn)(double))
 	{
 		CompactDownsamplerFIR_Key key(ratio, zero_crossings, window_fn);
-		if (compact_downsampler_firs.count(key) == 0) {
-			compact_downsampler_firs[key] = mk_compact_downsampler_fir(ratio, zero_crossings, window_fn);
-		}
-		return compact_downsampler_firs[key];
+		return _lookup(compact_downsampler_firs, key, [&]() {
+			char name[128];
+			snprintf(name, sizeof(name), "fir.g%d.r%d.z%d.w%016llx", FIR_GEN, ratio, zero_crossings, (unsigned long long)tables_hash_window_fn(window_fn));
+			return get_cached(name, ratio * zero_crossings - zero_crossings, [&]() {
+				return mk_compact_downsampler_fir(ratio, zero_crossings, window_fn);
+			});
+		});
 	}
 
 	// sinc
@@ -66,20 +280,21 @@ struct Tables {
 	{
 		int width = 1 << width_exp;
 		int width_mask = width - 1;
+		int half = width >> 1;
 		int phases = 1 << phases_exp;
 		double I0_beta = bessel_I0(beta);
 		double kPi = 4.0 * atan(1.0) * lowpass_factor;
 
-		T* tbl = (T*) malloc(sizeof(T) * phases * width);
+		T* tbl = alloc(phases * width);
 
 		for (int isrc = 0; isrc < width * phases; isrc++) {
 			double fsinc;
 			int ix = (width_mask - (isrc & width_mask)) * phases + (isrc >> width_exp);
-			if (ix == (4 * phases)) {
+			if (ix == (half * phases)) {
 				fsinc = 1.0;
 			} else {
-				double x = (double)(ix - (4 * phases)) * (double)(1.0 / phases);
-				fsinc = sin(x * kPi) * bessel_I0(beta * sqrt(1 - x*x*(1.0/16.0))) / (I0_beta*x*kPi); // Kaiser window
+				double x = (double)(ix - (half * phases)) * (double)(1.0 / phases);
+				fsinc = sin(x * kPi) * bessel_I0(beta * sqrt(1 - x*x*(1.0/(half*half)))) / (I0_beta*x*kPi); // Kaiser window
 			}
 			tbl[isrc] = fsinc * lowpass_factor;
 		}
@@ -90,10 +305,81 @@ struct Tables {
 	T* get_phased_sinc(double beta, double lowpass_factor, int width_exp, int phases_exp)
 	{
 		PhasedSinc_Key key(beta, lowpass_factor, width_exp, phases_exp);
-		if (phased_sincs.count(key) == 0) {
-			phased_sincs[key] = mk_phased_sinc(beta, lowpass_factor, width_exp, phases_exp);
+		return _lookup(phased_sincs, key, [&]() {
+			char name[128];
+			snprintf(name, sizeof(name), "sinc.g%d.b%a.l%a.w%d.p%d", SINC_GEN, beta, lowpass_factor, width_exp, phases_exp);
+			return get_cached(name, 1u << (width_exp + phases_exp), [&]() {
+				return mk_phased_sinc(beta, lowpass_factor, width_exp, phases_exp);
+			});
+		});
+	}
+
+	// the kernels sample playback picks from by increment: for pitches near
+	// the original, and for downsampling by about 2 and 1.333. shared by
+	// PolyphaseSmplr and Granular so that both sound the same
+	enum {
+		RESAMPLING_SINC_UNITY = 0,
+		RESAMPLING_SINC_DOWN2X,
+		RESAMPLING_SINC_DOWN1_333X,
+		RESAMPLING_SINC_COUNT
+	};
+
+	void get_resampling_sincs(int width_exp, int phases_exp, T** kernels)
+	{
+		kernels[RESAMPLING_SINC_UNITY] = get_phased_sinc(9.6377, 0.97, width_exp, phases_exp);
+		kernels[RESAMPLING_SINC_DOWN2X] = get_phased_sinc(2.7625, 0.425, width_exp, phases_exp);
+		kernels[RESAMPLING_SINC_DOWN1_333X] = get_phased_sinc(8.5, 0.5, width_exp, phases_exp);
+	}
+
+	// grain windows; (1 << size_exp) + 1 points spanning [0;1] so that
+	// lookups can interpolate without wrapping
+	enum {
+		GRAIN_WINDOW_HANN = 0,
+		GRAIN_WINDOW_GAUSS,
+		GRAIN_WINDOW_TRIANGLE,
+		GRAIN_WINDOW_COUNT
+	};
+
+	typedef std::tuple<int,int> GrainWindow_Key;
+	std::map<GrainWindow_Key, T*> grain_windows;
+
+	T* mk_grain_window(int kind, int size_exp)
+	{
+		int size = 1 << size_exp;
+		T* tbl = alloc(size + 1);
+
+		for (int i = 0; i <= size; i++) {
+			double x = (double)i / (double)size;
+			double w = 0.0;
+			switch (kind) {
+				case GRAIN_WINDOW_HANN:
+					w = 0.5 - 0.5 * cos(2.0 * M_PI * x);
+					break;
+				case GRAIN_WINDOW_GAUSS: {
+					double u = (x - 0.5) / 0.15;
+					w = exp(-0.5 * u * u);
+					break;
+				}
+				case GRAIN_WINDOW_TRIANGLE:
+					w = 1.0 - fabs(2.0 * x - 1.0);
+					break;
+			}
+			tbl[i] = w;
 		}
-		return phased_sincs[key];
+
+		return tbl;
+	}
+
+	T* get_grain_window(int kind, int size_exp)
+	{
+		GrainWindow_Key key(kind, size_exp);
+		return _lookup(grain_windows, key, [&]() {
+			char name[128];
+			snprintf(name, sizeof(name), "grain.g%d.k%d.s%d", GRAIN_GEN, kind, size_exp);
+			return get_cached(name, (1u << size_exp) + 1, [&]() {
+				return mk_grain_window(kind, size_exp);
+			});
+		});
 	}
 };
 
@@ -0,0 +1,232 @@
+#pragma once
+
+/*
+timeline tracing to a Chrome trace JSON file (chrome://tracing, Perfetto).
+
+TRACE_SCOPE(name) records a begin event and, when the scope ends, an end
+event into a ring buffer owned by the calling thread. names must be string
+literals (only the pointer is stored). a background thread started by
+TRACE_START(path) drains every thread's ring into the file about ten times a
+second; TRACE_STOP() drains what's left and closes the file. when a ring is
+full, events are dropped and counted rather than blocking the producer.
+
+events are meant for block level scopes (callbacks, event dispatch, voices,
+FFT stages); per-sample stages are better left to CBS_STAGE() in
+CallbackStats.h.
+
+everything compiles to nothing unless TRACE is defined (link with -pthread).
+TRACE_START() allocates and prefaults a ring per hardware thread (plus two),
+and a thread claims one on its first event with a compare-and-swap, so the
+audio thread never allocates or touches fresh pages. events from threads
+that find no ring left (or come before TRACE_START()) are dropped and
+counted.
+*/
+
+#ifdef TRACE
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "assert.h"
+
+struct TraceEvent {
+	int64_t ts_ns;
+	const char* name;
+	char phase; // 'B' or 'E'
+};
+
+// single producer (the owning thread), single consumer (the flusher)
+struct TraceRing {
+	static constexpr int SIZE_EXP = 16;
+	static constexpr uint32_t SIZE = 1 << SIZE_EXP;
+	static constexpr uint32_t MASK = SIZE - 1;
+
+	int tid;
+	std::atomic<uint32_t> head{0};
+	std::atomic<uint32_t> tail{0};
+	std::atomic<uint64_t> dropped{0};
+	TraceEvent events[SIZE];
+
+	inline void push(const char* name, char phase, int64_t ts_ns)
+	{
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) >= SIZE) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		TraceEvent& e = events[h & MASK];
+		e.ts_ns = ts_ns;
+		e.name = name;
+		e.phase = phase;
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+struct Trace {
+	static constexpr int MAX_THREADS = 64;
+
+	// rings[0, n_alloc) are allocated; [0, n_rings) claimed by threads
+	std::atomic<int> n_alloc{0};
+	std::atomic<int> n_rings{0};
+	TraceRing* rings[MAX_THREADS];
+	std::atomic<uint64_t> unclaimed_dropped{0};
+
+	FILE* file = nullptr;
+	int64_t t0_ns;
+	bool first_event;
+	std::atomic<bool> running{false};
+	std::thread flusher;
+
+	static Trace& get_instance()
+	{
+		static Trace instance;
+		return instance;
+	}
+
+	Trace() : t0_ns(now_ns()) {}
+	Trace(Trace const&) = delete;
+	void operator=(Trace const&) = delete;
+
+	static inline int64_t now_ns()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	void alloc_rings()
+	{
+		int n = std::thread::hardware_concurrency() + 2;
+		if (n > MAX_THREADS) n = MAX_THREADS;
+		for (int i = n_alloc.load(std::memory_order_relaxed); i < n; i++) {
+			TraceRing* ring = new TraceRing;
+			memset(ring->events, 0, sizeof(ring->events));
+			ring->tid = i + 1;
+			rings[i] = ring;
+		}
+		// publishes rings[] to claim()
+		n_alloc.store(n, std::memory_order_release);
+	}
+
+	TraceRing* claim()
+	{
+		const int n = n_alloc.load(std::memory_order_acquire);
+		int i = n_rings.load(std::memory_order_relaxed);
+		do {
+			if (i >= n) return nullptr;
+		} while (!n_rings.compare_exchange_weak(i, i + 1, std::memory_order_acq_rel));
+		return rings[i];
+	}
+
+	static inline TraceRing* get_ring()
+	{
+		static thread_local TraceRing* ring = nullptr;
+		if (ring == nullptr) {
+			ring = get_instance().claim();
+		}
+		return ring;
+	}
+
+	static inline void event(const char* name, char phase)
+	{
+		TraceRing* ring = get_ring();
+		if (ring == nullptr) {
+			get_instance().unclaimed_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		ring->push(name, phase, now_ns());
+	}
+
+	void drain()
+	{
+		int n = n_rings.load(std::memory_order_acquire);
+		for (int i = 0; i < n; i++) {
+			TraceRing* ring = rings[i];
+			uint32_t t = ring->tail.load(std::memory_order_relaxed);
+			uint32_t h = ring->head.load(std::memory_order_acquire);
+			for (; t != h; t++) {
+				TraceEvent& e = ring->events[t & TraceRing::MASK];
+				fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+					first_event ? "" : ",\n",
+					e.name,
+					e.phase,
+					(double)(e.ts_ns - t0_ns) * 1e-3,
+					(int)getpid(),
+					ring->tid);
+				first_event = false;
+			}
+			ring->tail.store(t, std::memory_order_release);
+		}
+	}
+
+	void start(const char* path)
+	{
+		ASSERT(file == nullptr);
+		file = fopen(path, "w");
+		if (file == nullptr) {
+			arghf("%s: %s", path, strerror(errno));
+		}
+		fprintf(file, "{\"traceEvents\":[\n");
+		first_event = true;
+		alloc_rings();
+		running.store(true);
+		flusher = std::thread([this]() {
+			while (running.load()) {
+				usleep(100000);
+				drain();
+			}
+		});
+	}
+
+	void stop()
+	{
+		if (file == nullptr) return;
+		running.store(false);
+		flusher.join();
+		drain();
+
+		uint64_t dropped = unclaimed_dropped.load();
+		int n = n_rings.load(std::memory_order_acquire);
+		for (int i = 0; i < n; i++) {
+			dropped += rings[i]->dropped.load();
+		}
+		fprintf(file, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu}}\n", (unsigned long long)dropped);
+		AZ(fclose(file));
+		file = nullptr;
+	}
+};
+
+struct TraceScope {
+	const char* name;
+
+	TraceScope(const char* name) : name(name)
+	{
+		Trace::event(name, 'B');
+	}
+
+	~TraceScope()
+	{
+		Trace::event(name, 'E');
+	}
+};
+
+#define _TRACE_CAT2(a, b) a##b
+#define _TRACE_CAT(a, b) _TRACE_CAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope _TRACE_CAT(_trace_scope_, __LINE__)(name)
+#define TRACE_START(path) Trace::get_instance().start(path)
+#define TRACE_STOP() Trace::get_instance().stop()
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_START(path)
+#define TRACE_STOP()
+
+#endif
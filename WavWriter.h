@@ -0,0 +1,114 @@
+#pragma once
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Dsp.h"
+#include "assert.h"
+
+/*
+streams interleaved float frames to a 16-bit PCM WAV file (the format
+SmplBx_Loader reads back). samples are clamped to [-1;1]; clipped counts
+them. the RIFF/data sizes are patched in by close().
+*/
+struct WavWriter {
+	static constexpr int BUFFER_SAMPLES = 8192;
+
+	FILE* file = nullptr;
+	const char* path = nullptr;
+	uint32_t sample_rate;
+	int num_channels;
+	uint64_t frames = 0;
+	uint64_t clipped = 0;
+	int16_t buffer[BUFFER_SAMPLES];
+	const DspKernels* dsp;
+
+	WavWriter() : dsp(dsp_get_kernels()) {}
+	WavWriter(WavWriter const&) = delete;
+	void operator=(WavWriter const&) = delete;
+
+	~WavWriter()
+	{
+		if (file != nullptr) close();
+	}
+
+	void _put_le(uint8_t* p, uint32_t value, int n)
+	{
+		for (int i = 0; i < n; i++) {
+			p[i] = (value >> (i*8)) & 0xff;
+		}
+	}
+
+	void _write_header(uint32_t data_size)
+	{
+		uint8_t h[44];
+		const int block_align = num_channels * 2;
+		memcpy(h, "RIFF", 4);
+		_put_le(h + 4, 36 + data_size, 4);
+		memcpy(h + 8, "WAVEfmt ", 8);
+		_put_le(h + 16, 16, 4);
+		_put_le(h + 20, 1, 2); // PCM
+		_put_le(h + 22, num_channels, 2);
+		_put_le(h + 24, sample_rate, 4);
+		_put_le(h + 28, sample_rate * block_align, 4);
+		_put_le(h + 32, block_align, 2);
+		_put_le(h + 34, 16, 2);
+		memcpy(h + 36, "data", 4);
+		_put_le(h + 40, data_size, 4);
+		if (fwrite(h, sizeof(h), 1, file) != 1) {
+			arghf("%s: %s", path, strerror(errno));
+		}
+	}
+
+	void open(const char* path_, uint32_t sample_rate_, int num_channels_)
+	{
+		ASSERT(file == nullptr);
+		path = path_;
+		sample_rate = sample_rate_;
+		num_channels = num_channels_;
+		frames = 0;
+		clipped = 0;
+		file = fopen(path, "wb");
+		if (file == nullptr) {
+			arghf("%s: %s", path, strerror(errno));
+		}
+		_write_header(0);
+	}
+
+	void write(const float* samples, int n_frames)
+	{
+		ASSERT(file != nullptr);
+		const int chunk = BUFFER_SAMPLES / num_channels;
+		while (n_frames > 0) {
+			int m = n_frames < chunk ? n_frames : chunk;
+			int ns = m * num_channels;
+			clipped += dsp->f32_to_s16(buffer, samples, ns); // little endian host
+			if (fwrite(buffer, sizeof(int16_t), ns, file) != (size_t)ns) {
+				arghf("%s: %s", path, strerror(errno));
+			}
+			frames += m;
+			samples += ns;
+			n_frames -= m;
+		}
+	}
+
+	void close()
+	{
+		ASSERT(file != nullptr);
+		uint64_t data_size = frames * num_channels * 2;
+		if (data_size > 0xffffffffull - 36) {
+			arghf("%s: too big for WAV", path);
+		}
+		if (fseek(file, 0, SEEK_SET) != 0) {
+			arghf("%s: %s", path, strerror(errno));
+		}
+		_write_header(data_size);
+		if (fclose(file) != 0) {
+			arghf("%s: %s", path, strerror(errno));
+		}
+		file = nullptr;
+	}
+};
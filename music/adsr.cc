@@ -1,19 +1,32 @@
 
+#include "BusBuffer.h"
 #include "Skaar.h"
 #include "PQ.h"
 #include "Math.h"
 #include "F6581.h"
 #include "FirOversampler.h"
 #include "ADSR.h"
+#include "Mod.h"
+#include "Quality.h"
+#include "CallbackStats.h"
+#include "Trace.h"
 
-#include <SDL.h>
+#include <stdio.h>
+
+#define MONO_BLOCK (256)
+static_assert(MONO_BLOCK <= MOD_BLOCK, "a block is modulated in one go");
 
 struct state {
-	KaiserBesselFirOversampler<Skaar<2, F6581<>, SkaarOsc<ADSR>>, 16, 2> skaar;
+	KaiserBesselDynFirOversampler<Skaar<2, F6581<>, SkaarOsc<ADSR>>, 16, 2> skaar;
 	PQ<void(*)(struct state*)> pq;
 	int64_t t = 0;
 	int tick = 0;
-	float t2 = 0;
+	FloatMono mono[MONO_BLOCK];
+	// slow sweeps of osc[0]'s shift and of the filter's fc
+	Lfo shift_lfo;
+	Lfo fc_lfo;
+	float mod_shift[MONO_BLOCK];
+	float mod_fc[MONO_BLOCK];
 
 	void queue(void(*callback)(struct state* state), int64_t dt)
 	{
@@ -90,15 +103,6 @@ static void song_tick(struct state* state)
 	state->queue(song_tick, 10000);
 }
 
-static void song_motion_tick(struct state* state)
-{
-	auto& skaar = state->skaar;
-	skaar.osc[0].set_shift(sinf(state->t2) * 0.48f);
-	skaar.filter.set_fc(sinf(state->t2*1.3f) * 1000 + 1000);
-	state->t2+=0.006f;
-	state->queue(song_motion_tick, 1000);
-}
-
 static void song_init(struct state* state)
 {
 	auto& skaar = state->skaar;
@@ -137,14 +141,21 @@ static void song_init(struct state* state)
 	filter.lowpass_gain = 1.0f;
 	filter.highpass_gain = 0.3f;
 
+	state->shift_lfo.hz = 0.0421f;
+	state->shift_lfo.depth = 0.48f;
+	state->fc_lfo.hz = 0.0421f * 1.3f;
+	state->fc_lfo.depth = 1000.0f;
+	state->fc_lfo.offset = 1000.0f;
+
 	state->queue(song_tick, 0);
-	state->queue(song_motion_tick, 0);
 }
 
 
 void state_init(struct state* state, int sample_rate)
 {
 	state->skaar.set_sample_rate(sample_rate);
+	state->shift_lfo.set_sample_rate(sample_rate);
+	state->fc_lfo.set_sample_rate(sample_rate);
 	state->queue(song_init, 0);
 
 }
@@ -152,9 +163,8 @@ void state_init(struct state* state, int sample_rate)
 static void audio_callback(struct state* state, float* q, int n)
 {
 	auto& skaar = state->skaar;
-	int i = 0;
-	//float min = 1e6;
-	//float max = -1e6;
+	skaar.set_quality(QualityGovernor::get_instance().get_level());
+	FloatStereo* out = (FloatStereo*) q;
 	while(n > 0) {
 		int64_t dt = 0;
 		auto& pq = state->pq;
@@ -162,69 +172,37 @@ static void audio_callback(struct state* state, float* q, int n)
 			while((dt = (pq.next_t() - state->t)) <= 0) {
 				void (*callback)(struct state*);
 				pq.shift(&callback);
+				CBS_STAGE(CBS_STAGE_DISPATCH);
+				TRACE_SCOPE("dispatch");
 				callback(state);
 			}
 		}
 		while(n > 0 && (pq.n == 0 || dt > 0)) {
-			float v = skaar.sample();
-			//if (v > max) max = v;
-			//if (v < min) min = v;
-			q[i<<1] = q[(i<<1)+1] = v;
-			i++;
-			dt--;
-			n--;
-			state->t++;
+			// render mono up to the next event, then copy it to both
+			// channels in one go
+			int m = n < MONO_BLOCK ? n : MONO_BLOCK;
+			if (pq.n > 0 && dt < m) m = dt;
+			state->shift_lfo.render(state->mod_shift, m);
+			state->fc_lfo.render(state->mod_fc, m);
+			skaar.osc[0].modulate(nullptr, state->mod_shift, m);
+			skaar.filter.modulate(state->mod_fc, nullptr, m);
+			for (int i = 0; i < m; i++) {
+				state->mono[i] = skaar.sample();
+			}
+			bus_pan(out, state->mono, 1.0f, 1.0f, m);
+			out += m;
+			dt -= m;
+			n -= m;
+			state->t += m;
 		}
 	}
-	//printf("[%f:%f]\n", min, max);
 }
 
 
 ////
 
-static void sdl_panic()
-{
-	fprintf(stderr, "SDL: %s\n", SDL_GetError());
-	exit(EXIT_FAILURE);
-}
-
-static void sdl_audio_callback(void* usr, Uint8* stream, int len)
-{
-	struct state* state = (struct state*) usr;
-	int n = len / (sizeof(float)*2);
-	float* fstream = (float*) stream;
-	audio_callback(state, fstream, n);
-}
-
-static void init_audio()
-{
-	struct state* state = new struct state;
-
-	SDL_AudioSpec want, have;
-	SDL_zero(want);
-	want.freq = 44100;
-	want.format = AUDIO_F32;
-	want.channels = 2;
-	want.samples = 256;
-	want.callback = sdl_audio_callback;
-	want.userdata = state;
-
-	SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
-	if(dev == 0) sdl_panic();
-
-	state_init(state, have.freq);
-
-	SDL_PauseAudioDevice(dev, 0);
-}
-
-int main(int argc, char** argv)
-{
-	if(SDL_Init(SDL_INIT_AUDIO) != 0) sdl_panic();
-
-	init_audio();
-
-	//SDL_Delay(1000);
-	fgetc(stdin);
-
-	return 0;
-}
+#ifdef HEADLESS
+#include "main_render.h"
+#else
+#include "main_sdl.h"
+#endif
@@ -0,0 +1,776 @@
+#include "Bus.h"
+#include "Dsp.h"
+#include "Skaar.h"
+#include "ADSR.h"
+#include "F6581.h"
+#include "FirOversampler.h"
+#include "Smpl.h"
+#include "SmplBx.h"
+#include "SmplPoly.h"
+#include "Granular.h"
+#include "Convolver.h"
+#include "PQ.h"
+#include "Quality.h"
+#include "Math.h"
+#include "Mod.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+microbenchmarks for the DSP building blocks, one component and template
+parameter set at a time. prints one JSON object per line:
+
+  {"bench":"F6581","params":{},"isa":"avx2","n":...,"ns_per_sample":...,"samples_per_s":...}
+
+"isa" is the Dsp.h kernel variant in use (DSP_ISA=sse2 etc. to compare).
+
+"sample" is one call to the component's sample() (one output frame for
+oversamplers and samplers, one insert+shift for PQ, one decoded frame for
+SmplBx_Loader). every run is repeated and the fastest pass is reported.
+
+the "Tail" benches check for denormal slowdowns instead; see bench_tail().
+bench exits with status 1 if one of them fails.
+
+usage: bench [substring to filter bench names] [sample path]
+*/
+
+static const int PASSES = 5;
+static const int SAMPLE_RATE = 44100;
+
+static const char* filter = nullptr;
+static const char* smpl_path = "WilhelmScream.wav";
+static volatile float sink;
+static bool failed = false;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static bool enabled(const char* name)
+{
+	return filter == nullptr || strstr(name, filter) != nullptr;
+}
+
+static void report(const char* name, const char* params, int64_t n, double best)
+{
+	double ns = best * 1e9 / (double)n;
+	printf("{\"bench\":\"%s\",\"params\":{%s},\"isa\":\"%s\",\"n\":%lld,\"ns_per_sample\":%.3f,\"samples_per_s\":%.0f}\n",
+		name, params, dsp_get_isa(), (long long)n, ns, 1e9 / ns);
+	fflush(stdout);
+}
+
+// runs fn(n) PASSES times and reports the fastest
+template <typename FN>
+static void run(const char* name, const char* params, int64_t n, FN fn)
+{
+	if (!enabled(name)) return;
+	double best = INFINITY;
+	for (int pass = 0; pass < PASSES; pass++) {
+		double t0 = now();
+		fn(n);
+		double dt = now() - t0;
+		if (dt < best) best = dt;
+	}
+	report(name, params, n, best);
+}
+
+// white noise source for the oversamplers
+template <typename BUS>
+struct BenchNoise {
+	typedef BUS T;
+	typedef typename BUS::T Q;
+
+	uint32_t x = 1;
+
+	void set_sample_rate(float) {}
+
+	inline BUS sample()
+	{
+		BUS value;
+		for (int ch = 0; ch < BUS::CH; ch++) {
+			x = x * 1664525 + 1013904223;
+			value.value[ch] = (Q)(int32_t)x * (Q)(1.0 / 2147483648.0);
+		}
+		return value;
+	}
+};
+
+// BenchNoise for left samples, then silence
+template <typename BUS>
+struct BenchBurst : BenchNoise<BUS> {
+	int64_t left = 0;
+
+	inline BUS sample()
+	{
+		if (left <= 0) return BUS();
+		left--;
+		return BenchNoise<BUS>::sample();
+	}
+};
+
+static void bench_skaar_osc(const char* flags_name, int flags)
+{
+	char params[128];
+	snprintf(params, sizeof(params), "\"flags\":\"%s\"", flags_name);
+	run("SkaarOsc", params, 1 << 22, [flags](int64_t n) {
+		SkaarOsc<ADSR> osc;
+		osc.set_sample_rate(SAMPLE_RATE);
+		osc.flags = flags;
+		osc.set_hz(440.0f);
+		osc.set_shift(0.1f);
+		osc.wavetable_fn(sinf);
+		osc.env.set_attack(0.01f, 0.01f);
+		osc.env.set_sustain(0.5f);
+		osc.env.set_decay(0.1f, 1.0f);
+		osc.env.set_release(0.5f, 1.0f);
+		osc.env.value = 0.0f;
+		osc.env.on();
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) {
+			acc += osc.sample();
+		}
+		sink = acc;
+	});
+}
+
+static void bench_adsr()
+{
+	// toggles on/off so that all the states get their share
+	run("ADSR", "", 1 << 22, [](int64_t n) {
+		ADSR env;
+		env.value = 0.0f;
+		env.set_sample_rate(SAMPLE_RATE);
+		env.set_attack(0.01f, 0.01f);
+		env.set_sustain(0.3f);
+		env.set_decay(0.02f, 1.0f);
+		env.set_release(0.02f, 1.0f);
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) {
+			if ((i & 4095) == 0) env.on();
+			if ((i & 4095) == 2048) env.off();
+			acc += env.sample();
+		}
+		sink = acc;
+	});
+}
+
+static void bench_f6581(int quality)
+{
+	char params[32];
+	snprintf(params, sizeof(params), "\"quality\":%d", quality);
+	run("F6581", params, 1 << 22, [quality](int64_t n) {
+		F6581<> filter;
+		filter.set_quality(quality);
+		filter.set_sample_rate(SAMPLE_RATE);
+		filter.set_fc(1100.0f);
+		filter.set_q(0.4f);
+		filter.lowpass_gain = 1.0f;
+		filter.bandpass_gain = 0.0f;
+		filter.highpass_gain = 0.3f;
+		filter.vlp = filter.vbp = filter.vhp = 0.0f;
+		BenchNoise<FloatMono> noise;
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) {
+			float v = noise.sample().value[0] * 0.1f;
+			acc += filter.sample(v * 0.5f, v);
+		}
+		sink = acc;
+	});
+}
+
+/*
+libm against Math.h's fast versions, one value per sample: "scalar" one call
+at a time, "sse" four per call. inputs cycle through a table in the range
+the synths use them in
+*/
+template <typename LIBM, typename FAST, typename FAST_PS>
+static void bench_math(const char* fn, float lo, float hi, LIBM libm, FAST fast, FAST_PS fast_ps)
+{
+	static const int N = 1024;
+	static float in[N] __attribute__((aligned(16)));
+	for (int i = 0; i < N; i++) in[i] = lo + (hi - lo) * (float)((i * 389) % N) / (float)N;
+	char params[64];
+	snprintf(params, sizeof(params), "\"fn\":\"%s\",\"impl\":\"libm\"", fn);
+	run("Math", params, 1 << 22, [libm](int64_t n) {
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) acc += libm(in[i & (N - 1)]);
+		sink = acc;
+	});
+	snprintf(params, sizeof(params), "\"fn\":\"%s\",\"impl\":\"scalar\"", fn);
+	run("Math", params, 1 << 22, [fast](int64_t n) {
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) acc += fast(in[i & (N - 1)]);
+		sink = acc;
+	});
+	snprintf(params, sizeof(params), "\"fn\":\"%s\",\"impl\":\"sse\"", fn);
+	run("Math", params, 1 << 22, [fast_ps](int64_t n) {
+		__m128 acc = _mm_setzero_ps();
+		for (int64_t i = 0; i < n; i += 4) acc = _mm_add_ps(acc, fast_ps(_mm_load_ps(in + (i & (N - 1)))));
+		float out[4];
+		_mm_storeu_ps(out, acc);
+		sink = out[0] + out[1] + out[2] + out[3];
+	});
+}
+
+static void bench_math_all()
+{
+	bench_math("exp2", -20.0f, 20.0f, [](float x) { return exp2f(x); },
+		[](float x) { return fast_exp2f(x); }, [](__m128 x) { return fast_exp2_ps(x); });
+	bench_math("log2", 1e-3f, 1e3f, [](float x) { return log2f(x); },
+		[](float x) { return fast_log2f(x); }, [](__m128 x) { return fast_log2_ps(x); });
+	bench_math("semitones", -48.0f, 48.0f, [](float x) { return powf(2.0f, x / 12.0f); },
+		[](float x) { return fast_semitonesf(x); }, [](__m128 x) { return fast_semitones_ps(x); });
+	bench_math("sin", -6.28f, 6.28f, [](float x) { return sinf(x); },
+		[](float x) { return fast_sinf(x); }, [](__m128 x) { return fast_sin_ps(x); });
+}
+
+template <int RATIO, int ZERO_CROSSINGS, int CH>
+static void bench_fir_oversampler()
+{
+	char params[128];
+	snprintf(params, sizeof(params), "\"RATIO\":%d,\"ZERO_CROSSINGS\":%d,\"CH\":%d", RATIO, ZERO_CROSSINGS, CH);
+	run("FirOversampler", params, (1 << 22) / (RATIO * ZERO_CROSSINGS), [](int64_t n) {
+		KaiserBesselFirOversampler<BenchNoise<Bus<float, CH>>, RATIO, ZERO_CROSSINGS> os;
+		memset(os._fo_buffer, 0, sizeof(os._fo_buffer));
+		os.set_sample_rate(SAMPLE_RATE);
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) {
+			acc += os.sample().sum();
+		}
+		sink = acc;
+	});
+}
+
+/*
+a whole Skaar voice as the programs use it, with its notes held and after
+they've been released for long enough that the voice is asleep; and with a
+dynamic oversampling ratio, at a few pitches
+*/
+typedef KaiserBesselFirOversampler<Skaar<2, F6581<>, SkaarOsc<ADSR>>, 16, 2> BenchSkaarVoice;
+typedef KaiserBesselDynFirOversampler<Skaar<2, F6581<>, SkaarOsc<ADSR>>, 16, 2> BenchSkaarDynVoice;
+
+template <typename VOICE>
+static void bench_skaar_voice_init(VOICE& skaar, float hz)
+{
+	skaar.set_sample_rate(SAMPLE_RATE);
+	for (auto& osc : skaar.osc) {
+		osc.flags = osc.SAW;
+		osc.gain = 0.1f;
+		osc.gain_filter = 1.0f;
+		osc.env.value = 0.0f;
+		osc.env.set_attack(0.01f, 0.01f);
+		osc.env.set_sustain(0.1f);
+		osc.env.set_decay(0.1f, 1.0f);
+		osc.env.set_release(0.5f, 1.0f);
+		osc.set_hz(hz);
+		osc.env.on();
+	}
+	skaar.filter.vlp = skaar.filter.vbp = skaar.filter.vhp = 0.0f;
+	skaar.filter.set_fc(1100.0f);
+	skaar.filter.set_q(0.4f);
+	skaar.filter.lowpass_gain = 1.0f;
+	skaar.filter.bandpass_gain = 0.0f;
+	skaar.filter.highpass_gain = 0.3f;
+}
+
+static void bench_skaar_voice()
+{
+	run("SkaarVoice", "\"state\":\"playing\"", 1 << 16, [](int64_t n) {
+		BenchSkaarVoice skaar;
+		memset(skaar._fo_buffer, 0, sizeof(skaar._fo_buffer));
+		bench_skaar_voice_init(skaar, 220.0f);
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) acc += skaar.sample();
+		sink = acc;
+	});
+	BenchSkaarVoice* idle = new BenchSkaarVoice;
+	memset(idle->_fo_buffer, 0, sizeof(idle->_fo_buffer));
+	bench_skaar_voice_init(*idle, 220.0f);
+	for (auto& osc : idle->osc) osc.env.off();
+	for (int i = 0; i < SAMPLE_RATE * 2; i++) idle->sample();
+	if (!idle->sleeping()) fprintf(stderr, "SkaarVoice: released voice didn't go to sleep\n");
+	run("SkaarVoice", "\"state\":\"idle\"", 1 << 22, [idle](int64_t n) {
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i++) acc += idle->sample();
+		sink = acc;
+	});
+	delete idle;
+
+	// ratios only go down after DOWN_DELAY; measure the settled one
+	for (float hz : { 40.0f, 220.0f, 880.0f }) {
+		BenchSkaarDynVoice* skaar = new BenchSkaarDynVoice;
+		bench_skaar_voice_init(*skaar, hz);
+		for (int i = 0; i < skaar->DOWN_DELAY * 2; i++) skaar->sample();
+		char params[96];
+		snprintf(params, sizeof(params), "\"state\":\"playing\",\"hz\":%g,\"ratio\":%d", hz, skaar->get_ratio());
+		run("SkaarDynVoice", params, 1 << 16, [skaar](int64_t n) {
+			float acc = 0.0f;
+			for (int64_t i = 0; i < n; i++) acc += skaar->sample();
+			sink = acc;
+		});
+		delete skaar;
+	}
+
+	// shift, fc and a vibrato from LFOs, passed in blocks of MOD_BLOCK
+	run("SkaarVoice", "\"state\":\"modulated\"", 1 << 16, [](int64_t n) {
+		BenchSkaarVoice* skaar = new BenchSkaarVoice;
+		memset(skaar->_fo_buffer, 0, sizeof(skaar->_fo_buffer));
+		bench_skaar_voice_init(*skaar, 220.0f);
+		Lfo vibrato, shift, fc;
+		vibrato.set_sample_rate(SAMPLE_RATE);
+		vibrato.hz = 5.0f;
+		vibrato.depth = 0.2f;
+		shift.set_sample_rate(SAMPLE_RATE);
+		shift.hz = 0.3f;
+		shift.depth = 0.4f;
+		fc.set_sample_rate(SAMPLE_RATE);
+		fc.hz = 0.5f;
+		fc.depth = 300.0f;
+		fc.offset = 900.0f;
+		float mod_pitch[MOD_BLOCK], mod_shift[MOD_BLOCK], mod_fc[MOD_BLOCK];
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i += MOD_BLOCK) {
+			vibrato.render(mod_pitch, MOD_BLOCK);
+			shift.render(mod_shift, MOD_BLOCK);
+			fc.render(mod_fc, MOD_BLOCK);
+			for (auto& osc : skaar->osc) osc.modulate(mod_pitch, mod_shift, MOD_BLOCK);
+			skaar->filter.modulate(mod_fc, nullptr, MOD_BLOCK);
+			for (int j = 0; j < MOD_BLOCK; j++) acc += skaar->sample();
+		}
+		sink = acc;
+		delete skaar;
+	});
+}
+
+/*
+modulation sources, one value per frame, rendered MOD_BLOCK at a time
+*/
+static void bench_mod()
+{
+	static float out[MOD_BLOCK];
+	static const char* shapes[] = { "sine", "triangle", "saw" };
+	for (int shape = Lfo::SINE; shape <= Lfo::SAW; shape++) {
+		char params[64];
+		snprintf(params, sizeof(params), "\"shape\":\"%s\"", shapes[shape]);
+		run("Lfo", params, 1 << 22, [shape](int64_t n) {
+			Lfo lfo;
+			lfo.set_sample_rate(SAMPLE_RATE);
+			lfo.shape = shape;
+			lfo.hz = 3.0f;
+			float acc = 0.0f;
+			for (int64_t i = 0; i < n; i += MOD_BLOCK) {
+				lfo.render(out, MOD_BLOCK);
+				acc += out[0];
+			}
+			sink = acc;
+		});
+	}
+	// a breakpoint every ~1000 frames
+	run("Automation", "", 1 << 22, [](int64_t n) {
+		Automation curve;
+		for (int k = 0; k < Automation::MAX_POINTS; k++) {
+			curve.add((int64_t)k * (n / Automation::MAX_POINTS), (float)(k & 3));
+		}
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i += MOD_BLOCK) {
+			curve.render(out, MOD_BLOCK);
+			acc += out[0];
+		}
+		sink = acc;
+	});
+}
+
+template <int SINC_WIDTH_EXP, int CH>
+static void bench_polyphase_smplr(Smpl<Bus<float, CH>>* smpl, float ratio, bool block, int quality = QUALITY_HIGH)
+{
+	char params[160];
+	snprintf(params, sizeof(params), "\"SINC_WIDTH_EXP\":%d,\"CH\":%d,\"ratio\":%g,\"render\":%s,\"quality\":%d",
+		SINC_WIDTH_EXP, CH, ratio, block ? "true" : "false", quality);
+	run("PolyphaseSmplr", params, 1 << 21, [smpl, ratio, block, quality](int64_t n) {
+		typedef Bus<float, CH> BUS;
+		PolyphaseSmplr<BUS, SINC_WIDTH_EXP> smplr;
+		smplr.smpl = smpl;
+		smplr.set_quality(quality);
+		smplr.set_sample_rate(SAMPLE_RATE);
+		smplr.set_hz(smpl->base * ratio);
+		BUS out[256];
+		float acc = 0.0f;
+		for (int64_t i = 0; i < n; i += 256) {
+			if (block) {
+				smplr.render(out, 256);
+			} else {
+				for (int j = 0; j < 256; j++) {
+					out[j] = smplr.sample();
+				}
+			}
+			acc += out[0].sum();
+			if (smplr.pos_fx >> smplr.FRAC_EXP >= (int64_t)smpl->frames - 512) {
+				smplr.set_pos(0);
+			}
+		}
+		sink = acc;
+	});
+}
+
+template <int SINC_WIDTH_EXP, int CH>
+static void bench_polyphase_smplr_all()
+{
+	typedef Bus<float, CH> BUS;
+	// a noise sample without a loop, big enough to miss the cache
+	const int frames = 1 << 20;
+	Smpl<BUS>* smpl = Smpl<BUS>::alloc(frames);
+	BenchNoise<BUS> noise;
+	for (int i = 0; i < frames; i++) {
+		smpl->data[i] = noise.sample();
+	}
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.0f, false);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.0f, true);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.189f, false);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.189f, true);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 2.5f, false);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.189f, false, QUALITY_MEDIUM);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.189f, false, QUALITY_LOW);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 1.0f, true, QUALITY_LOW);
+	bench_polyphase_smplr<SINC_WIDTH_EXP, CH>(smpl, 2.0f, true, QUALITY_LOW);
+	free(smpl);
+}
+
+/*
+GRAINS concurrent grains of 50 ms over a noise sample, at random positions,
+pitches (an octave down to an octave up) and pans; a grain ending is
+replaced by a new one, so the count stays put. "sample" is a grain-frame.
+*/
+static void bench_granular()
+{
+	typedef FloatStereo BUS;
+	static const int GRAINS = 1000;
+	static const int GRAIN_FRAMES = SAMPLE_RATE / 20;
+	const int frames = 1 << 20;
+	Smpl<BUS>* smpl = Smpl<BUS>::alloc(frames);
+	BenchNoise<BUS> noise;
+	for (int i = 0; i < frames; i++) {
+		smpl->data[i] = noise.sample();
+	}
+	smpl->base = 440.0f;
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"grains\":%d,\"grain_ms\":50,\"CH\":%d", GRAINS, BUS::CH);
+	run("Granular", params, (int64_t)GRAINS * SAMPLE_RATE, [smpl, frames](int64_t n) {
+		auto* gr = new Granular<BUS>;
+		gr->smpl = smpl;
+		gr->set_sample_rate(SAMPLE_RATE);
+		uint32_t x = 1;
+		auto spawn = [gr, frames, &x](int64_t at, float duration) {
+			x = x * 1664525 + 1013904223;
+			const double pos = (double)(x >> 12) * (double)(frames - GRAIN_FRAMES * 2) / (double)(1 << 20);
+			x = x * 1664525 + 1013904223;
+			const float hz = 440.0f * exp2f((float)(x >> 8) * (2.0f / 16777216.0f) - 1.0f);
+			x = x * 1664525 + 1013904223;
+			const float pan = (float)(x >> 8) * (2.0f / 16777216.0f) - 1.0f;
+			gr->spawn(at, pos, hz, duration, x % Tables<float>::GRAIN_WINDOW_COUNT, 0.01f, pan);
+		};
+		// staggered lengths to start with, so GRAINS are playing from the
+		// first frame on
+		for (int i = 0; i < GRAINS; i++) {
+			spawn(0, 0.05f * (float)(i + 1) / (float)GRAINS);
+		}
+		BUS out[256];
+		float acc = 0.0f;
+		double next = (double)GRAIN_FRAMES / GRAINS;
+		for (int64_t t = 0; t < n / GRAINS; t += 256) {
+			for (; next < (double)(t + 256); next += (double)GRAIN_FRAMES / GRAINS) {
+				spawn((int64_t)next, 0.05f);
+			}
+			gr->render(out, 256);
+			acc += out[0].sum();
+		}
+		sink = acc + (float)gr->n;
+		delete gr;
+	});
+	free(smpl);
+}
+
+static void bench_pq(int depth)
+{
+	char params[64];
+	snprintf(params, sizeof(params), "\"depth\":%d", depth);
+	run("PQ", params, 1 << 21, [depth](int64_t n) {
+		PQ<void*> pq;
+		uint32_t x = 1;
+		int64_t t = 0;
+		for (int i = 0; i < depth; i++) {
+			x = x * 1664525 + 1013904223;
+			void* v = nullptr;
+			pq.insert(t + (x >> 20), &v);
+		}
+		for (int64_t i = 0; i < n; i++) {
+			void* v;
+			t = pq.next_t();
+			pq.shift(&v);
+			x = x * 1664525 + 1013904223;
+			pq.insert(t + (x >> 20), &v);
+		}
+		sink = (float)t;
+	});
+}
+
+template <typename STORE>
+static void bench_smplbx_loader()
+{
+	char params[64];
+	snprintf(params, sizeof(params), "\"fmt\":\"%s\",\"CH\":%d", SmplBxTypeId<typename STORE::T>::value, STORE::CH);
+
+	SmplBx_Loader ldr(smpl_path);
+	if (!ldr.open() || !ldr.chkfmt() || ldr.get_num_channels() != STORE::CH) {
+		return;
+	}
+	int64_t frames = ldr.get_num_frames();
+	STORE* data = (STORE*) malloc(sizeof(STORE) * frames);
+	AN(data);
+	run("SmplBx_Loader", params, frames, [&ldr, data](int64_t) {
+		ldr.populate<STORE>(data);
+	});
+	free(data);
+}
+
+/*
+silent tails. a component is played, released and then rendered through
+TAIL_SECONDS of silence, timed a second at a time (each second is the
+fastest of its slices, which filters out preemption; at least TAIL_MIN_SLICES
+of them, so with long slices a "second" runs longer). denormal arithmetic
+costs tens of times more than normal arithmetic, so a component whose state
+decays into denormal range gets slower as the tail goes on; a second costing
+more than TAIL_MAX_RATIO times the first (give or take a nanosecond, for
+components that cost next to nothing once silent) fails the bench.
+
+this runs with FTZ/DAZ off, so that it's the components themselves being
+tested and not the MXCSR of whatever thread renders them. informational
+tails are reported but never fail the run: the OnePole control, a bare
+one-pole decay that does go denormal around second 5 to show that the
+check catches it, and the Convolver, whose big FFTs are memory bound and
+swing by more than TAIL_MAX_RATIO between seconds with nothing changing.
+
+render(n) returns whether the component still did its work on the slice
+(a voice that went to sleep or was retired only measures a memset); a tail
+that stops working fails as well. a component whose work comes in periods
+longer than TAIL_SLICE (the Convolver's stages) passes its period as slice,
+so that every slice costs the same while nothing changes.
+*/
+static const int TAIL_SECONDS = 8;
+static const int TAIL_SLICE = 4096;
+static const int TAIL_MIN_SLICES = 8;
+static const double TAIL_MAX_RATIO = 1.5;
+
+template <typename RENDER>
+static void bench_tail(const char* component, bool informational, RENDER render, int slice = TAIL_SLICE)
+{
+	if (!enabled("Tail")) return;
+	unsigned int csr = _mm_getcsr();
+	_mm_setcsr(csr & ~0x8040);
+
+	double first = 0.0, worst = 0.0;
+	bool worked = true;
+	for (int s = 0; s < TAIL_SECONDS; s++) {
+		double best = INFINITY;
+		for (int i = 0; i < SAMPLE_RATE || i < slice * TAIL_MIN_SLICES; i += slice) {
+			double t0 = now();
+			worked = render(slice) && worked;
+			double dt = now() - t0;
+			if (dt < best) best = dt;
+		}
+		double ns = best * 1e9 / (double)slice;
+		if (s == 0) first = ns;
+		if (ns > worst) worst = ns;
+	}
+	_mm_setcsr(csr);
+
+	double ratio = worst / first;
+	bool ok = informational || (worked && worst <= first * TAIL_MAX_RATIO + 1.0);
+	if (!ok) failed = true;
+	printf("{\"bench\":\"Tail\",\"params\":{\"component\":\"%s\",\"informational\":%s},\"isa\":\"%s\",\"ns_per_sample_first\":%.3f,\"ns_per_sample_worst\":%.3f,\"ratio\":%.2f,\"worked\":%s,\"ok\":%s}\n",
+		component, informational ? "true" : "false", dsp_get_isa(), first, worst, ratio, worked ? "true" : "false", ok ? "true" : "false");
+	fflush(stdout);
+}
+
+static void bench_tails()
+{
+	{
+		float y = 1.0f;
+		const float c = 1.0f - 87.3f / (5.0f * SAMPLE_RATE); // 1 -> 1e-38 in 5s
+		bench_tail("OnePole", true, [&y, c](int n) {
+			for (int i = 0; i < n; i++) y *= c;
+			sink = y;
+			return true;
+		});
+	}
+
+	{
+		BenchSkaarVoice skaar;
+		memset(skaar._fo_buffer, 0, sizeof(skaar._fo_buffer));
+		bench_skaar_voice_init(skaar, 220.0f);
+		for (int i = 0; i < SAMPLE_RATE / 2; i++) skaar.sample();
+		for (auto& osc : skaar.osc) osc.env.off();
+		// the released voice would go to sleep after a few ms; time the
+		// oscillators and filter running through the tail instead
+		skaar.can_sleep = false;
+		bench_tail("Skaar", false, [&skaar](int n) {
+			float acc = 0.0f;
+			for (int i = 0; i < n; i++) acc += skaar.sample();
+			sink = acc;
+			return !skaar.sleeping();
+		});
+	}
+
+	{
+		// half a second of noise, then silence in. F6581Params map silence
+		// to the middle of the SID's voltage range, where the state settles
+		// without ever nearing denormals; these map it to zero, so the
+		// state decays toward zero like a voice's would
+		struct ZeroParams : F6581Params {
+			static constexpr float MAP_NEG() { return -F6581Params::MAP_POS(); }
+		};
+		F6581<ZeroParams> filter;
+		filter.set_sample_rate(SAMPLE_RATE);
+		filter.set_fc(1100.0f);
+		filter.set_q(0.4f);
+		filter.lowpass_gain = 1.0f;
+		filter.bandpass_gain = 0.0f;
+		filter.highpass_gain = 0.3f;
+		filter.vlp = filter.vbp = filter.vhp = 0.0f;
+		BenchNoise<FloatMono> noise;
+		for (int i = 0; i < SAMPLE_RATE / 2; i++) {
+			float v = noise.sample().value[0] * 0.1f;
+			filter.sample(v * 0.5f, v);
+		}
+		bench_tail("F6581", false, [&filter](int n) {
+			float acc = 0.0f;
+			for (int i = 0; i < n; i++) acc += filter.sample(0.0f, 0.0f);
+			sink = acc;
+			return true;
+		});
+	}
+
+	{
+		KaiserBesselFirOversampler<BenchBurst<FloatStereo>, 16, 2> os;
+		memset(os._fo_buffer, 0, sizeof(os._fo_buffer));
+		os.set_sample_rate(SAMPLE_RATE);
+		os.left = SAMPLE_RATE / 2 * 16;
+		for (int i = 0; i < SAMPLE_RATE / 2; i++) os.sample();
+		bench_tail("FirOversampler", false, [&os](int n) {
+			float acc = 0.0f;
+			for (int i = 0; i < n; i++) acc += os.sample().sum();
+			sink = acc;
+			return true;
+		});
+	}
+
+	{
+		// voices held at a low gain, on a sample long enough not to end
+		// within the tail
+		typedef FloatStereo BUS;
+		const int frames = 1 << 20;
+		Smpl<BUS>* smpl = Smpl<BUS>::alloc(frames);
+		BenchNoise<BUS> noise;
+		for (int i = 0; i < frames; i++) smpl->data[i] = noise.sample();
+		smpl->base = 440.0f;
+		auto* poly = new SmplPoly<BUS, 16>;
+		poly->set_sample_rate(SAMPLE_RATE);
+		poly->set_smpl(smpl);
+		BUS out[TAIL_SLICE];
+		SmplPoly<BUS, 16>::Handle notes[8];
+		for (int i = 0; i < 8; i++) notes[i] = poly->note_on(440.0f * (1.0f + i * 0.1f), 0.1f);
+		poly->render(out, TAIL_SLICE);
+		for (int i = 0; i < 8; i++) poly->set_gain(notes[i], 1e-4f);
+		bench_tail("SmplPoly", false, [poly, &out](int n) {
+			poly->render(out, n);
+			sink = out[0].sum();
+			return poly->n_active == 8;
+		});
+		delete poly;
+		free(smpl);
+	}
+
+	SmplBx_Loader ldr(smpl_path);
+	if (ldr.open() && ldr.chkfmt() && ldr.get_num_channels() == 2) {
+		// the sample as an impulse response, after half a second of noise.
+		// the stages run on periods of up to max_block frames, all dividing
+		// it, so max_block frames is every stage's work once
+		SmplBx smplbx;
+		auto* conv = new Convolver<FloatStereo>;
+		conv->load(smplbx, smpl_path, SAMPLE_RATE);
+		BenchNoise<FloatStereo> noise;
+		FloatStereo buf[256];
+		for (int i = 0; i < SAMPLE_RATE / 2; i += 256) {
+			for (int j = 0; j < 256; j++) buf[j] = noise.sample();
+			conv->process(buf, buf, 256);
+		}
+		bench_tail("Convolver", true, [conv, &buf](int n) {
+			for (int i = 0; i < n; i += 256) {
+				memset(buf, 0, sizeof(buf));
+				conv->process(buf, buf, 256);
+			}
+			sink = buf[0].sum();
+			return true;
+		}, conv->max_block);
+		delete conv;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1) filter = argv[1];
+	if (argc > 2) smpl_path = argv[2];
+
+	bench_skaar_osc("SAW", SkaarOsc<ADSR>::SAW);
+	bench_skaar_osc("SQR", SkaarOsc<ADSR>::SQR);
+	bench_skaar_osc("TRI", SkaarOsc<ADSR>::TRI);
+	bench_skaar_osc("NOI", SkaarOsc<ADSR>::NOI);
+	bench_skaar_osc("WAV", SkaarOsc<ADSR>::WAV);
+	bench_skaar_osc("SAW|TRI", SkaarOsc<ADSR>::SAW | SkaarOsc<ADSR>::TRI);
+
+	bench_math_all();
+	bench_mod();
+
+	bench_adsr();
+	bench_f6581(QUALITY_HIGH);
+	bench_f6581(QUALITY_MEDIUM);
+	bench_skaar_voice();
+
+	bench_fir_oversampler<2, 8, 1>();
+	bench_fir_oversampler<4, 8, 1>();
+	bench_fir_oversampler<8, 8, 1>();
+	bench_fir_oversampler<16, 2, 1>();
+	bench_fir_oversampler<16, 8, 1>();
+	bench_fir_oversampler<16, 16, 1>();
+	bench_fir_oversampler<10, 2, 1>();
+	bench_fir_oversampler<10, 2, 2>();
+	bench_fir_oversampler<16, 8, 2>();
+
+	bench_polyphase_smplr_all<2, 1>();
+	bench_polyphase_smplr_all<3, 1>();
+	bench_polyphase_smplr_all<4, 1>();
+	bench_polyphase_smplr_all<2, 2>();
+	bench_polyphase_smplr_all<3, 2>();
+	bench_polyphase_smplr_all<4, 2>();
+
+	bench_granular();
+
+	bench_pq(16);
+	bench_pq(256);
+	bench_pq(4096);
+
+	bench_smplbx_loader<FloatMono>();
+	bench_smplbx_loader<FloatStereo>();
+	bench_smplbx_loader<S16Stereo>();
+	bench_smplbx_loader<F16Stereo>();
+
+	bench_tails();
+
+	return failed ? 1 : 0;
+}
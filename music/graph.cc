@@ -0,0 +1,141 @@
+#include "Bus.h"
+#include "Skaar.h"
+#include "F6581.h"
+#include "FirOversampler.h"
+#include "ADSR.h"
+#include "Smpl.h"
+#include "SmplBx.h"
+#include "SmplPoly.h"
+#include "Graph.h"
+#include "RenderPool.h"
+#include "PQ.h"
+#include "Quality.h"
+#include "Math.h"
+#include "CallbackStats.h"
+#include "Trace.h"
+
+#include <stdio.h>
+
+/*
+a Skaar lead and a sampler, mixed through a Graph: the lead plays into a synth
+submix, the sampler goes to the master directly and through a send into the
+synth submix, and the submix goes to the master. the lead and the sampler are
+independent, so they run in parallel when there are cores for it.
+*/
+
+typedef KaiserBesselDynFirOversampler<Skaar<2, F6581<>, SkaarOsc<ADSR>>, 16, 2> Lead;
+typedef GraphSampler<FloatStereo, Lead> LeadNode;
+typedef GraphRenderer<FloatStereo, SmplPoly<FloatStereo, 16>> SmplNode;
+
+struct state {
+	SmplBx smplbx;
+	RenderPool pool;
+	Graph<FloatStereo> graph;
+	int lead, smpl, synth, master;
+
+	PQ<void(*)(struct state*)> pq;
+	int64_t t = 0;
+	int tick = 0;
+
+	void queue(void(*callback)(struct state* state), int64_t dt)
+	{
+		pq.insert(t + dt, &callback);
+	}
+
+	void render(FloatStereo* out, int n)
+	{
+		graph.process(out, n);
+	}
+};
+
+
+static void audio_callback(struct state* state, float* q, int n)
+{
+	const int quality = QualityGovernor::get_instance().get_level();
+	state->graph.get<LeadNode>(state->lead).sampler.set_quality(quality);
+	state->graph.get<SmplNode>(state->smpl).renderer.set_quality(quality);
+	FloatStereo* out = (FloatStereo*) q;
+	while(n > 0) {
+		int64_t dt = 0;
+		auto& pq = state->pq;
+		while(pq.n > 0 && (dt = (pq.next_t() - state->t)) <= 0) {
+			void (*callback)(struct state*);
+			pq.shift(&callback);
+			CBS_STAGE(CBS_STAGE_DISPATCH);
+			TRACE_SCOPE("dispatch");
+			callback(state);
+		}
+		// render up to the next event in one block
+		int m = (pq.n == 0 || dt > n) ? n : dt;
+		state->render(out, m);
+		out += m;
+		n -= m;
+		state->t += m;
+	}
+}
+
+
+static int some_notes[] = { 0, 3, 7, 12, 10, 7, 3, -2 };
+
+static void song_tick(struct state* state)
+{
+	int tick = state->tick++;
+	auto& lead = state->graph.get<LeadNode>(state->lead).sampler;
+	lead.osc[0].set_hz(note_to_hz(200.0f, some_notes[tick % 8]));
+	lead.osc[1].set_hz(note_to_hz(100.0f, some_notes[tick % 8]));
+	lead.osc[0].env.on();
+	lead.osc[1].env.on();
+	if ((tick & 7) == 0) {
+		state->graph.get<SmplNode>(state->smpl).renderer.note_on(440, 0.1f);
+	}
+	state->queue(song_tick, 10000);
+}
+
+void state_init(struct state* state, int sample_rate)
+{
+	auto& graph = state->graph;
+	state->lead = graph.add(new LeadNode);
+	state->smpl = graph.add(new SmplNode);
+	state->synth = graph.add(new GraphMix<FloatStereo>(0.7f));
+	state->master = graph.add(new GraphMix<FloatStereo>(1.0f));
+
+	graph.connect(state->lead, state->synth);
+	graph.connect(state->smpl, state->synth, 0, 0.3f);
+	graph.connect(state->smpl, state->master, 0, 0.5f);
+	graph.connect(state->synth, state->master);
+	graph.set_output(state->master);
+	graph.set_sample_rate(sample_rate);
+	graph.pool = &state->pool;
+	graph.compile();
+
+	auto& lead = graph.get<LeadNode>(state->lead).sampler;
+	lead.gain = 0.05f;
+	for (int i = 0; i < 2; i++) {
+		auto& osc = lead.osc[i];
+		osc.flags = i == 0 ? osc.SQR : osc.SAW;
+		osc.gain_filter = 1.0f;
+		osc.gain = 0.1f;
+		osc.env.value = 0.0f;
+		osc.env.set_attack(0.01f, 0.01f);
+		osc.env.set_sustain(0.1f);
+		osc.env.set_decay(0.1f, 1.0f);
+		osc.env.set_release(0.5f, 1.0f);
+	}
+	lead.filter.vlp = lead.filter.vbp = lead.filter.vhp = 0.0f;
+	lead.filter.set_fc(2048.0f - 900);
+	lead.filter.set_q(0.4f);
+	lead.filter.lowpass_gain = 1.0f;
+	lead.filter.bandpass_gain = 0.0f;
+	lead.filter.highpass_gain = 0.3f;
+
+	auto& smplr = graph.get<SmplNode>(state->smpl).renderer;
+	smplr.set_smpl(state->smplbx.load<FloatStereo>("WilhelmScream.wav", sample_rate));
+
+	state->queue(song_tick, 0);
+}
+
+#ifdef HEADLESS
+#include "main_render.h"
+#else
+#include "main_sdl.h"
+#endif
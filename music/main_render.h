@@ -0,0 +1,84 @@
+#pragma once
+
+/*
+renders a program offline, as fast as the CPU allows, to a WAV file. drives
+the same state_init()/audio_callback() as main_sdl.h, in callback-sized
+blocks, so the PQ sees the same timeline as it does live. no SDL involved.
+TRACE builds write a timeline to trace.json.
+
+usage: <program> [out.wav] [seconds] [sample rate] [block frames]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Dsp.h"
+#include "WavWriter.h"
+#include "CallbackStats.h"
+#include "Math.h"
+#include "Trace.h"
+
+static double render_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : "out.wav";
+	double seconds = argc > 2 ? atof(argv[2]) : 30.0;
+	int sample_rate = argc > 3 ? atoi(argv[3]) : 44100;
+	int block = argc > 4 ? atoi(argv[4]) : 256;
+	if (seconds <= 0.0 || sample_rate <= 0 || block <= 0) {
+		fprintf(stderr, "usage: %s [out.wav] [seconds] [sample rate] [block frames]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	TRACE_START("trace.json");
+	disable_denormals();
+
+	struct state* state = new struct state;
+	state_init(state, sample_rate);
+
+	WavWriter wav;
+	wav.open(path, sample_rate, 2);
+
+	float* buffer = (float*) malloc(sizeof(float) * 2 * block);
+	AN(buffer);
+
+	// per block stats, as if each block was a callback of a live run
+	CallbackStats stats;
+
+	int64_t total = (int64_t)(seconds * (double)sample_rate);
+	double render_time = 0.0;
+	for (int64_t i = 0; i < total; i += block) {
+		int n = (total - i) < block ? (int)(total - i) : block;
+		TRACE_SCOPE("block");
+		double t0 = render_now();
+		stats.begin();
+		audio_callback(state, buffer, n);
+		stats.end(n, sample_rate);
+		render_time += render_now() - t0;
+		wav.write(buffer, n);
+	}
+	wav.close();
+	TRACE_STOP();
+
+	// rendering only; file writes are not counted
+	double rendered = (double)total / (double)sample_rate;
+	fprintf(stderr, "\n%s: %.2fs of audio in %.3fs, %.1fx real time (%s kernels)", path, rendered, render_time, rendered / render_time, dsp_get_isa());
+	if (wav.clipped > 0) {
+		fprintf(stderr, ", %llu samples clipped", (unsigned long long)wav.clipped);
+	}
+	fprintf(stderr, "\n");
+
+	CallbackStats_Snapshot snapshot;
+	stats.read(&snapshot);
+	snapshot.print(stderr, "");
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+/*
+plays a program through SDL in real time. included at the bottom of a
+program, after it has defined struct state, state_init() and
+audio_callback().
+
+usage: <program> [-s] [-a blocks] [-q]
+
+every render is timed by CallbackStats. the main thread prints a summary
+when it exits, and a line per second with -s. TRACE builds write a timeline
+to trace.json.
+
+by default the SDL callback renders synchronously. with -a the program
+renders on a thread of its own, the given number of blocks ahead of the
+device (see RenderAhead.h), and the callback just copies; entering "+" or
+"-" adjusts the number of blocks while playing, and underruns are reported
+with the stats. any other input quits.
+
+-q enables adaptive quality (see Quality.h): the load of every render drives
+the QualityGovernor, and the level it's at is reported with the stats.
+*/
+
+#include <SDL.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CallbackStats.h"
+#include "Math.h"
+#include "Quality.h"
+#include "RenderAhead.h"
+#include "Tables.h"
+#include "Trace.h"
+
+static const int SDL_BLOCK = 256;
+
+static CallbackStats callback_stats;
+static int sdl_sample_rate;
+static RenderAhead* render_ahead = nullptr;
+
+static void sdl_panic()
+{
+	fprintf(stderr, "SDL: %s\n", SDL_GetError());
+	exit(EXIT_FAILURE);
+}
+
+static void timed_render(void* usr, float* out, int n)
+{
+	struct state* state = (struct state*) usr;
+	// the callback may come from any thread SDL likes; MXCSR is per thread
+	disable_denormals();
+	TRACE_SCOPE("render");
+	callback_stats.begin();
+	audio_callback(state, out, n);
+	callback_stats.end(n, sdl_sample_rate);
+	QualityGovernor::get_instance().update(callback_stats.live.last_ns, callback_stats.live.budget_ns);
+}
+
+static void sdl_audio_callback(void* usr, Uint8* stream, int len)
+{
+	int n = len / (sizeof(float)*2);
+	float* fstream = (float*) stream;
+	TRACE_SCOPE("callback");
+	if (render_ahead != nullptr) {
+		render_ahead->read(fstream, n);
+	} else {
+		timed_render(usr, fstream, n);
+	}
+}
+
+static void init_audio(int ahead_blocks)
+{
+	struct state* state = new struct state;
+
+	SDL_AudioSpec want, have;
+	SDL_zero(want);
+	want.freq = 44100;
+	want.format = AUDIO_F32;
+	want.channels = 2;
+	want.samples = SDL_BLOCK;
+	want.callback = sdl_audio_callback;
+	want.userdata = state;
+
+	SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+	if(dev == 0) sdl_panic();
+
+	sdl_sample_rate = have.freq;
+	state_init(state, have.freq);
+	// every voice exists by now; a table built after this point would be
+	// built on the audio thread
+	Tables<float>::get_instance().freeze();
+
+	if (ahead_blocks > 0) {
+		// room for up to 4x the requested amount, for runtime tuning
+		render_ahead = new RenderAhead(2, SDL_BLOCK, have.freq, ahead_blocks * 4, timed_render, state);
+		render_ahead->set_ahead(ahead_blocks);
+		render_ahead->start();
+	}
+
+	SDL_PauseAudioDevice(dev, 0);
+}
+
+static void print_status(CallbackStats_Snapshot* snapshot)
+{
+	if (render_ahead != nullptr) {
+		fprintf(stderr, "\nahead %d blocks (%.1fms)  underruns %llu (%llu frames)",
+			render_ahead->ahead_blocks.load(),
+			(double)render_ahead->get_latency() * 1e3 / (double)sdl_sample_rate,
+			(unsigned long long)render_ahead->underruns.load(),
+			(unsigned long long)render_ahead->underrun_frames.load());
+	}
+	QualityGovernor& quality = QualityGovernor::get_instance();
+	if (quality.enabled) {
+		fprintf(stderr, "\nquality level %d  steps down %llu",
+			quality.get_level(),
+			(unsigned long long)quality.steps_down.load());
+	}
+	snapshot->print(stderr, "\n");
+}
+
+int main(int argc, char** argv)
+{
+	if(SDL_Init(SDL_INIT_AUDIO) != 0) sdl_panic();
+
+	bool print_stats = false;
+	int ahead_blocks = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0) {
+			print_stats = true;
+		} else if (strcmp(argv[i], "-a") == 0 && (i + 1) < argc) {
+			ahead_blocks = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0) {
+			QualityGovernor::get_instance().enabled = true;
+		} else {
+			fprintf(stderr, "usage: %s [-s] [-a blocks] [-q]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	TRACE_START("trace.json");
+	init_audio(ahead_blocks);
+
+	CallbackStats_Snapshot snapshot;
+	while (true) {
+		struct pollfd pfd;
+		pfd.fd = 0;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) != 0) {
+			char line[64];
+			if (render_ahead == nullptr || fgets(line, sizeof(line), stdin) == NULL) break;
+			if (line[0] == '+') {
+				render_ahead->set_ahead(render_ahead->ahead_blocks.load() + 1);
+			} else if (line[0] == '-') {
+				render_ahead->set_ahead(render_ahead->ahead_blocks.load() - 1);
+			} else {
+				break;
+			}
+			callback_stats.read(&snapshot);
+			print_status(&snapshot);
+			continue;
+		}
+		if (print_stats) {
+			callback_stats.read(&snapshot);
+			print_status(&snapshot);
+		}
+	}
+
+	if (render_ahead != nullptr) render_ahead->stop();
+
+	callback_stats.read(&snapshot);
+	print_status(&snapshot);
+
+	TRACE_STOP();
+
+	return 0;
+}
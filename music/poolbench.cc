@@ -0,0 +1,125 @@
+#include "Skaar.h"
+#include "F6581.h"
+#include "FirOversampler.h"
+#include "ADSR.h"
+#include "RenderPool.h"
+#include "Math.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+renders VOICES independent Skaar chains (as in adsr.cc) for a number of
+seconds, first on the calling thread alone, then through a RenderPool with
+each voice a task, and reports the speedup and whether the two mixes are
+bit-identical.
+
+usage: poolbench [voices] [seconds] [workers]
+*/
+
+typedef KaiserBesselFirOversampler<Skaar<2, F6581<>, SkaarOsc<ADSR>>, 16, 2> Voice;
+
+static const int SAMPLE_RATE = 44100;
+static const int BLOCK = 256;
+static const int MAX_VOICES = 256;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void voice_init(Voice& v, int i)
+{
+	memset(v._fo_buffer, 0, sizeof(v._fo_buffer));
+	v.set_sample_rate(SAMPLE_RATE);
+	v.gain = 0.02f;
+	for (int j = 0; j < 2; j++) {
+		auto& osc = v.osc[j];
+		osc.flags = j == 0 ? osc.SQR : osc.SAW;
+		osc.gain_filter = 1.0f;
+		osc.gain = 0.1f;
+		osc.set_hz(note_to_hz(110.0f, (i * 7 + j * 12) % 36));
+		osc.env.value = 0.0f;
+		osc.env.set_attack(0.01f, 0.01f);
+		osc.env.set_sustain(0.3f);
+		osc.env.set_decay(0.1f, 1.0f);
+		osc.env.set_release(0.5f, 1.0f);
+		osc.env.on();
+	}
+	v.filter.vlp = v.filter.vbp = v.filter.vhp = 0.0f;
+	v.filter.set_fc(1000.0f + 20.0f * i);
+	v.filter.set_q(0.4f);
+	v.filter.lowpass_gain = 1.0f;
+	v.filter.bandpass_gain = 0.0f;
+	v.filter.highpass_gain = 0.3f;
+}
+
+struct voices {
+	Voice v[MAX_VOICES];
+};
+
+static void render_voice(void* ctx, int task, FloatMono* out, int n)
+{
+	Voice& v = ((struct voices*) ctx)->v[task];
+	for (int i = 0; i < n; i++) {
+		out[i] = v.sample();
+	}
+}
+
+static double run(int n_voices, int64_t frames, RenderPool* pool, FloatMono* out)
+{
+	struct voices* vs = new struct voices;
+	for (int i = 0; i < n_voices; i++) voice_init(vs->v[i], i);
+
+	PoolMixer<FloatMono, MAX_VOICES, BLOCK>* mixer = nullptr;
+	FloatMono* scratch = new FloatMono[BLOCK];
+	if (pool != nullptr) mixer = new PoolMixer<FloatMono, MAX_VOICES, BLOCK>(pool);
+
+	double t0 = now();
+	for (int64_t i = 0; i < frames; i += BLOCK) {
+		FloatMono* o = out + i;
+		if (pool != nullptr) {
+			mixer->render(o, BLOCK, n_voices, render_voice, vs);
+		} else {
+			// same summation order as PoolMixer
+			memset(o, 0, sizeof(FloatMono) * BLOCK);
+			for (int t = 0; t < n_voices; t++) {
+				render_voice(vs, t, scratch, BLOCK);
+				for (int j = 0; j < BLOCK; j++) o[j] += scratch[j];
+			}
+		}
+	}
+	double dt = now() - t0;
+
+	delete mixer;
+	delete[] scratch;
+	delete vs;
+	return dt;
+}
+
+int main(int argc, char** argv)
+{
+	int n_voices = argc > 1 ? atoi(argv[1]) : 32;
+	double seconds = argc > 2 ? atof(argv[2]) : 5.0;
+	int n_workers = argc > 3 ? atoi(argv[3]) : -1;
+	ASSERT(n_voices > 0 && n_voices <= MAX_VOICES);
+
+	int64_t frames = (int64_t)(seconds * SAMPLE_RATE) / BLOCK * BLOCK;
+	FloatMono* ref = new FloatMono[frames];
+	FloatMono* out = new FloatMono[frames];
+
+	double t1 = run(n_voices, frames, nullptr, ref);
+	RenderPool pool(n_workers);
+	double tn = run(n_voices, frames, &pool, out);
+
+	printf("voices %d, %.1fs of audio, %d threads\n", n_voices, (double)frames / SAMPLE_RATE, pool.n_threads);
+	printf("1 thread:  %.3fs (%.1fx real time)\n", t1, (double)frames / SAMPLE_RATE / t1);
+	printf("pool:      %.3fs (%.1fx real time), %.2fx speedup\n", tn, (double)frames / SAMPLE_RATE / tn, t1 / tn);
+	printf("bit-identical: %s\n", memcmp(ref, out, sizeof(FloatMono) * frames) == 0 ? "yes" : "NO");
+
+	delete[] ref;
+	delete[] out;
+	return 0;
+}
@@ -2,16 +2,17 @@
 #include "Bus.h"
 #include "Smpl.h"
 #include "SmplBx.h"
-#include "FirOversampler.h"
+#include "SmplPoly.h"
 #include "PQ.h"
+#include "Quality.h"
 #include "Math.h"
 #include "Tables.h"
-
-#include <SDL.h>
+#include "CallbackStats.h"
+#include "Trace.h"
 
 struct state {
 	SmplBx smplbx;
-	KaiserBesselFirOversampler<PolyphaseSmplr<FloatStereo>, 10, 2> smplr;
+	SmplPoly<FloatStereo, 16> smplr;
 
 	PQ<void(*)(struct state*)> pq;
 	int64_t t = 0;
@@ -23,57 +24,42 @@ struct state {
 		pq.insert(t + dt, &callback);
 	}
 
-	FloatStereo sample()
+	void render(FloatStereo* out, int n)
 	{
-		return smplr.sample() * 0.1f;
+		CBS_STAGE(CBS_STAGE_VOICES);
+		TRACE_SCOPE("render");
+		smplr.render(out, n);
 	}
 };
 
 
 static void audio_callback(struct state* state, float* q, int n)
 {
-	int i = 0;
+	state->smplr.set_quality(QualityGovernor::get_instance().get_level());
+	FloatStereo* out = (FloatStereo*) q;
 	while(n > 0) {
 		int64_t dt = 0;
 		auto& pq = state->pq;
-		if(pq.n > 0) {
-			while((dt = (pq.next_t() - state->t)) <= 0) {
-				void (*callback)(struct state*);
-				pq.shift(&callback);
-				callback(state);
-			}
-		}
-		while(n > 0 && (pq.n == 0 || dt > 0)) {
-			auto v = state->sample();
-			q[i<<1] = v[0];
-			q[(i<<1)+1] = v[1];
-			i++;
-			dt--;
-			n--;
-			state->t++;
+		while(pq.n > 0 && (dt = (pq.next_t() - state->t)) <= 0) {
+			void (*callback)(struct state*);
+			pq.shift(&callback);
+			CBS_STAGE(CBS_STAGE_DISPATCH);
+			TRACE_SCOPE("dispatch");
+			callback(state);
 		}
+		// render up to the next event in one block
+		int m = (pq.n == 0 || dt > n) ? n : dt;
+		state->render(out, m);
+		out += m;
+		n -= m;
+		state->t += m;
 	}
 }
 
 
-static void sdl_panic()
-{
-	fprintf(stderr, "SDL: %s\n", SDL_GetError());
-	exit(EXIT_FAILURE);
-}
-
-static void sdl_audio_callback(void* usr, Uint8* stream, int len)
-{
-	struct state* state = (struct state*) usr;
-	int n = len / (sizeof(float)*2);
-	float* fstream = (float*) stream;
-	audio_callback(state, fstream, n);
-}
-
 static void song_tick(struct state* state)
 {
-	state->smplr.set_hz(440);
-	state->smplr.set_pos(0);
+	state->smplr.note_on(440, 0.1f);
 	state->queue(song_tick, state->tick_delay);
 	state->tick_delay += 10;
 	state->tick_delay *= 1.1;
@@ -83,40 +69,14 @@ void state_init(struct state* state, int sample_rate)
 {
 	auto* smplr = &state->smplr;
 	smplr->set_sample_rate(sample_rate);
-	state->smplr.smpl = state->smplbx.load<FloatStereo>("WilhelmScream.wav");
+	// resampled to the device rate, so the root pitch plays as a copy
+	smplr->set_smpl(state->smplbx.load<FloatStereo>("WilhelmScream.wav", sample_rate));
 
 	state->queue(song_tick, 0);
 }
 
-static void init_audio()
-{
-	struct state* state = new struct state;
-
-	SDL_AudioSpec want, have;
-	SDL_zero(want);
-	want.freq = 44100;
-	want.format = AUDIO_F32;
-	want.channels = 2;
-	want.samples = 256;
-	want.callback = sdl_audio_callback;
-	want.userdata = state;
-
-	SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
-	if(dev == 0) sdl_panic();
-
-	state_init(state, have.freq);
-
-	SDL_PauseAudioDevice(dev, 0);
-}
-
-int main(int argc, char** argv)
-{
-	if(SDL_Init(SDL_INIT_AUDIO) != 0) sdl_panic();
-
-	init_audio();
-
-	fgetc(stdin);
-
-	return 0;
-}
-
+#ifdef HEADLESS
+#include "main_render.h"
+#else
+#include "main_sdl.h"
+#endif
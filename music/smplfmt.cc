@@ -0,0 +1,98 @@
+#include "Bus.h"
+#include "Smpl.h"
+#include "SmplBx.h"
+
+#include <math.h>
+#include <time.h>
+
+/*
+compares Smpl storage formats: plays the same sample stored as f32, s16 and
+f16 through PolyphaseSmplr at a non-unity pitch, and reports per-voice
+memory traffic, speed and the error relative to the f32 rendition.
+*/
+
+static const float HZ = 523.25f; // off the 440 base, so the full kernel runs
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+template <typename STORE>
+static FloatStereo* render(const char* path, uint64_t* n_out, double* ns_per_frame)
+{
+	SmplBx smplbx;
+	PolyphaseSmplr<FloatStereo, 3, 12, STORE> smplr;
+	smplr.smpl = smplbx.load<STORE>(path);
+	smplr.set_sample_rate(smplr.smpl->sample_rate);
+	smplr.set_hz(HZ);
+
+	uint64_t n = (uint64_t)((double)smplr.smpl->frames * 440.0 / HZ);
+	FloatStereo* out = (FloatStereo*) malloc(sizeof(FloatStereo) * n);
+	AN(out);
+
+	const int passes = 20;
+	double t0 = now();
+	for (int pass = 0; pass < passes; pass++) {
+		smplr.set_pos(0);
+		for (uint64_t i = 0; i < n; i++) {
+			out[i] = smplr.sample();
+		}
+	}
+	double t1 = now();
+
+	*n_out = n;
+	*ns_per_frame = (t1 - t0) * 1e9 / (double)(n * passes);
+	return out;
+}
+
+template <typename STORE>
+static void report(const char* path, FloatStereo* ref)
+{
+	uint64_t n;
+	double ns;
+	FloatStereo* out = render<STORE>(path, &n, &ns);
+
+	double sig = 0.0;
+	double err = 0.0;
+	double peak = 0.0;
+	for (uint64_t i = 0; i < n; i++) {
+		for (int ch = 0; ch < 2; ch++) {
+			double s = ref[i][ch];
+			double e = out[i][ch] - s;
+			sig += s * s;
+			err += e * e;
+			if (fabs(e) > peak) peak = fabs(e);
+		}
+	}
+	double snr = err > 0.0 ? 10.0 * log10(sig / err) : INFINITY;
+
+	printf("%s\t%d\t%.2f\t%.2f\t%.1f\t%g\n",
+		SmplBxTypeId<typename STORE::T>::value,
+		(int)sizeof(STORE),
+		(double)sizeof(STORE) * HZ / 440.0, // source bytes consumed per output frame
+		ns,
+		snr,
+		peak);
+
+	free(out);
+}
+
+int main(int argc, char** argv)
+{
+	const char* path = argc > 1 ? argv[1] : "WilhelmScream.wav";
+
+	printf("fmt\tbytes/frame\tbytes/out\tns/frame\tsnr_db\tpeak_err\n");
+
+	uint64_t n;
+	double ns;
+	FloatStereo* ref = render<FloatStereo>(path, &n, &ns);
+	report<FloatStereo>(path, ref);
+	report<S16Stereo>(path, ref);
+	report<F16Stereo>(path, ref);
+	free(ref);
+
+	return 0;
+}
@@ -1,12 +1,16 @@
 
 #include "Bus.h"
+#include "BusBuffer.h"
 #include "Smpl.h"
 #include "FirOversampler.h"
 #include "PQ.h"
+#include "Quality.h"
 #include "Math.h"
 #include "Tables.h"
+#include "CallbackStats.h"
+#include "Trace.h"
 
-#include <SDL.h>
+#define MONO_BLOCK (256)
 
 struct state {
 	KaiserBesselFirOversampler<PolyphaseSmplr<FloatMono>, 10, 2> smplr;
@@ -15,6 +19,7 @@ struct state {
 	int64_t t = 0;
 	int tick = 0;
 	float hz = 4;
+	FloatMono mono[MONO_BLOCK];
 
 	void queue(void(*callback)(struct state* state), int64_t dt)
 	{
@@ -30,9 +35,8 @@ struct state {
 
 static void audio_callback(struct state* state, float* q, int n)
 {
-	int i = 0;
-	//float min = 1e6;
-	//float max = -1e6;
+	state->smplr.set_quality(QualityGovernor::get_instance().get_level());
+	FloatStereo* out = (FloatStereo*) q;
 	while(n > 0) {
 		int64_t dt = 0;
 		auto& pq = state->pq;
@@ -40,37 +44,28 @@ static void audio_callback(struct state* state, float* q, int n)
 			while((dt = (pq.next_t() - state->t)) <= 0) {
 				void (*callback)(struct state*);
 				pq.shift(&callback);
+				CBS_STAGE(CBS_STAGE_DISPATCH);
+				TRACE_SCOPE("dispatch");
 				callback(state);
 			}
 		}
 		while(n > 0 && (pq.n == 0 || dt > 0)) {
-			float v = state->sample();
-			//if (v > max) max = v;
-			//if (v < min) min = v;
-			q[i<<1] = q[(i<<1)+1] = v;
-			i++;
-			dt--;
-			n--;
-			state->t++;
+			// render mono up to the next event, then copy it to both
+			// channels in one go
+			int m = n < MONO_BLOCK ? n : MONO_BLOCK;
+			if (pq.n > 0 && dt < m) m = dt;
+			for (int i = 0; i < m; i++) {
+				state->mono[i] = state->sample();
+			}
+			bus_pan(out, state->mono, 1.0f, 1.0f, m);
+			out += m;
+			dt -= m;
+			n -= m;
+			state->t += m;
 		}
 	}
-	//printf("[%f:%f]\n", min, max);
-}
-
-
-static void sdl_panic()
-{
-	fprintf(stderr, "SDL: %s\n", SDL_GetError());
-	exit(EXIT_FAILURE);
 }
 
-static void sdl_audio_callback(void* usr, Uint8* stream, int len)
-{
-	struct state* state = (struct state*) usr;
-	int n = len / (sizeof(float)*2);
-	float* fstream = (float*) stream;
-	audio_callback(state, fstream, n);
-}
 
 static void song_tick(struct state* state)
 {
@@ -93,34 +88,8 @@ void state_init(struct state* state, int sample_rate)
 	state->queue(song_tick, 0);
 }
 
-static void init_audio()
-{
-	struct state* state = new struct state;
-
-	SDL_AudioSpec want, have;
-	SDL_zero(want);
-	want.freq = 44100;
-	want.format = AUDIO_F32;
-	want.channels = 2;
-	want.samples = 256;
-	want.callback = sdl_audio_callback;
-	want.userdata = state;
-
-	SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
-	if(dev == 0) sdl_panic();
-
-	state_init(state, have.freq);
-
-	SDL_PauseAudioDevice(dev, 0);
-}
-
-int main(int argc, char** argv)
-{
-	if(SDL_Init(SDL_INIT_AUDIO) != 0) sdl_panic();
-
-	init_audio();
-
-	fgetc(stdin);
-
-	return 0;
-}
+#ifdef HEADLESS
+#include "main_render.h"
+#else
+#include "main_sdl.h"
+#endif